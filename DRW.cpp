@@ -5,6 +5,7 @@
  */
  
 // std libraries for strings, I/O, and vector.
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include <fstream>
@@ -14,6 +15,7 @@
 
 #include <boost/graph/strong_components.hpp>
 #include <boost/graph/transitive_closure.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "DRW.hpp"
 #include "utils.hpp"
@@ -31,7 +33,7 @@ std::string DRW::to_string(){
     s.append("\n# List of transitions: \n");
     for(int i = 0; i < this->size; i++){
         for(int j = 0; j < this->alphabet_size; j++){
-            int k = this->transition_matrix[i][j];
+            int k = this->transition(i, j);
             s.append( INT_TO_STR(i+1) );
             s.append( " > " );
             s.append( INT_TO_STR(j+1) );
@@ -105,7 +107,7 @@ std::string DRW::to_digraph(){
             string label;
             // write down all characters on which state i goes to state k
             for (int j = 0; j < this->alphabet_size; j++){
-                int target = this->transition_matrix[i][j];
+                int target = this->transition(i, j);
                 if (target == k){
                     label.append(",");
                     if(this->char_labels.size() == 0)
@@ -129,8 +131,28 @@ std::string DRW::to_digraph(){
     return s;
 }
 
-int DRW::transition(int state, int character) const{
-    return this->transition_matrix[state-1][character-1];
+TransitionTable::TransitionTable(){
+    this->alphabet_size = 0;
+    this->wide = false;
+}
+
+void TransitionTable::resize(int states, int alphabet_size){
+    std::size_t entries = (std::size_t)states * alphabet_size;
+    this->alphabet_size = alphabet_size;
+    this->wide = (states > 65536);
+    std::vector<uint16_t>().swap(this->narrow_entries);
+    std::vector<uint32_t>().swap(this->wide_entries);
+    if(this->wide)
+        this->wide_entries.resize(entries, 0);
+    else
+        this->narrow_entries.resize(entries, 0);
+}
+
+void TransitionTable::swap(TransitionTable& other){
+    std::swap(this->alphabet_size, other.alphabet_size);
+    std::swap(this->wide, other.wide);
+    this->narrow_entries.swap(other.narrow_entries);
+    this->wide_entries.swap(other.wide_entries);
 }
 
 DRW::DRW(){
@@ -142,13 +164,12 @@ DRW::DRW(){
      * have been initialized or not.
      */
     this->num_sccs = -1; 
+    this->pair_mask_words = 0;
 }
 
 DRW::~DRW(){
     delete this->t_matrix;
     delete this->sccs;
-    for(int i = 0; i < this->transition_matrix.size(); i++)
-        delete [] this->transition_matrix[i];
     for(int i = 0; i < this->pairs.size(); i++)
         delete this->pairs[i];
 }
@@ -190,9 +211,7 @@ DRW* DRW::parse(char* filename) {
         ret->alphabet_size = atoi(s.c_str());
         
         // allocate memory for transition matrix
-        for(int i = 0; i < ret->size; i++){
-            ret->transition_matrix.push_back(new int[ret->alphabet_size]);
-        }        
+        ret->transition_matrix.resize(ret->size, ret->alphabet_size);
 
         // process transitions
         for(int i = 0; i < (ret->size * ret->alphabet_size); i++){
@@ -207,7 +226,7 @@ DRW* DRW::parse(char* filename) {
             getline(iss, part, ' '); // part contains the second arrow
             getline(iss, part, ' '); // part contains the target state
             int state_to = atoi(part.c_str());
-            ret->transition_matrix[state_from-1][char_on-1] = state_to-1;
+            ret->transition_matrix.set(state_from-1, char_on-1, state_to-1);
         }
         
         // read initial state
@@ -273,7 +292,7 @@ void DRW::build_boost_components(){
         
         for(int i = 0; i < this->size; i++){
             for(int j = 0; j < this->alphabet_size; j++){
-                add_edge(i, this->transition_matrix[i][j], *t_matrix);
+                add_edge(i, this->transition(i, j), *t_matrix);
             }
         }
         
@@ -295,136 +314,741 @@ void DRW::print_components(){
 }
         
 /*
- * Determine if the language of the automaton is empty.
- * Assumes that every state is reachable since Safra's construction only builds
- * the reachable part of the Rabin automaton.
- * Uses the following algorithm to check emptiness -- suppose that the Rabin 
- * pairs are given as (FIN, INF).
- *    For each Rabin acceptance pair, see if that pair can be satisfied:
- *      A state in INF with a path to itself which does not pass through
- *      any states in FIN is required to satisfy the pair.
- *    If the pair can be satisfied, the automaton is not empty.
- * Uses BGL implementation of Tarjan's algorithm to identify strongly connected
- * components.
+ * Transpose the Rabin pairs into per-state FIN and INF masks, using the same
+ * number of blocks per set as the keys built in complement().
  */
-bool DRW::is_empty(){
-    using namespace boost;  
+void DRW::build_pair_masks(){
+    int words = (this->pairs.size() + 63) / 64;
+    if(words == 0) words = 1;
+    this->pair_mask_words = words;
+    this->fin_masks.assign((std::size_t)this->size * words, 0UL);
+    this->inf_masks.assign((std::size_t)this->size * words, 0UL);
+    for(int p = 0; p < this->pairs.size(); p++){
+        const RabinPair* pair = this->pairs[p];
+        unsigned long bit = 1UL << (p % 64);
+        for(int q = pair->finite.find_first(); q >= 0 && q < this->size; q = pair->finite.find_next(q))
+            this->fin_masks[q * words + p / 64] |= bit;
+        for(int q = pair->infinite.find_first(); q >= 0 && q < this->size; q = pair->infinite.find_next(q))
+            if(!pair->finite[q])
+                this->inf_masks[q * words + p / 64] |= bit;
+    }
+}
+
+/*
+ * The states which lie on some cycle: those in a strongly connected
+ * component with more than one state, or with a self-loop.
+ */
+state_set_t DRW::cyclic_states(){
+    this->build_boost_components();
+    
+    std::vector<int> component_size(this->num_sccs, 0);
+    std::vector<bool> nontrivial(this->num_sccs, false);
+    for(int i = 0; i < this->size; i++){
+        component_size[(*this->sccs)[i]]++;
+        if(this->has_self_loop(i))
+            nontrivial[(*this->sccs)[i]] = true;
+    }
     
+    state_set_t cyclic(this->size);
+    for(int i = 0; i < this->size; i++){
+        int c = (*this->sccs)[i];
+        if(nontrivial[c] || component_size[c] > 1)
+            cyclic.set(i);
+    }
+    return cyclic;
+}
+
+/*
+ * The cyclic states in those components where @param pair can be satisfied,
+ * i.e. the components which contain a cyclic state of its INF set.
+ */
+state_set_t DRW::active_states(const RabinPair& pair, const state_set_t& cyclic){
+    std::vector<bool> satisfiable(this->num_sccs, false);
+    for(int i = 0; i < this->size; i++)
+        if(pair.infinite[i] && cyclic[i])
+            satisfiable[(*this->sccs)[i]] = true;
+            
+    state_set_t active(this->size);
+    for(int i = 0; i < this->size; i++)
+        if(cyclic[i] && satisfiable[(*this->sccs)[i]])
+            active.set(i);
+    return active;
+}
+
+/*
+ * Rewrite the Rabin pairs so that states which cannot influence acceptance
+ * have the same (empty) membership. Does not change the language.
+ */
+void DRW::normalize_pairs(){
+    state_set_t cyclic = this->cyclic_states();
     for(int p = 0; p < this->pairs.size(); p++){
-        /* To check the satifiability of the current pair, we first check to see
-         * if there is a state in INF with a self-loop. This satisfies the pair
-         * if present. Otherwise, we build a copy of 
-         * the reachability graph (transition matrix ignoring labels) for the 
-         * automaton, ignoring the states in FIN for the current pair. Then,
-         * we calculate the strongly connected components of that graph. 
-         * If there is any component of size >1 with a node in INF, the pair is
-         * satisfied.
-         */
+        state_set_t active = this->active_states(*this->pairs[p], cyclic);
+        this->pairs[p]->finite &= active;
+        this->pairs[p]->infinite &= active;
+    }
+}
+
+/*
+ * Remove Rabin pairs which cannot matter, working one strongly connected
+ * component at a time (an infinite run eventually stays in one component,
+ * so acceptance only depends on the pairs' restrictions to that component).
+ *  - A pair whose INF set misses every cyclic state is never satisfied.
+ *  - Two pairs which agree on every component where both can be satisfied
+ *    are merged: the merged pair behaves like whichever of the two can be
+ *    satisfied in each component.
+ *  - A pair P is dropped if some other pair Q is satisfied whenever P is:
+ *    on every component where P can be satisfied, INF(P) is contained in
+ *    INF(Q) and FIN(Q) is contained in FIN(P).
+ * The surviving pairs are left in the form produced by normalize_pairs().
+ * Returns the number of pairs removed.
+ */
+int DRW::reduce_pairs(){
+    int old_count = this->pairs.size();
+    state_set_t cyclic = this->cyclic_states();
+    
+    std::vector<RabinPair*> kept;
+    std::vector<state_set_t> kept_active;
+    
+    for(int p = 0; p < this->pairs.size(); p++){
+        RabinPair* pair = this->pairs[p];
+        state_set_t active = this->active_states(*pair, cyclic);
+        if(active.none()){
+            delete pair;
+            continue;
+        }
+        pair->finite &= active;
+        pair->infinite &= active;
         
-        // look for single states with loops
-        for(int i = 0; i < this->size; i++){
-            if(this->pairs[p]->infinite[i]){
-                for(int j = 0; j < this->alphabet_size; j++)
-                    if(this->transition_matrix[i][j] = i)
-                        return false; //automaton is not empty
-            }        
-        }         
+        // try to merge it into a pair we are keeping
+        bool merged = false;
+        for(int q = 0; q < kept.size() && !merged; q++){
+            state_set_t both = active & kept_active[q];
+            if( (pair->finite & both) == (kept[q]->finite & both)
+                && (pair->infinite & both) == (kept[q]->infinite & both) ){
+                state_set_t only_p = active - kept_active[q];
+                kept[q]->finite |= (pair->finite & only_p);
+                kept[q]->infinite |= (pair->infinite & only_p);
+                kept_active[q] |= active;
+                merged = true;
+            }
+        }
+        if(merged){
+            delete pair;
+        } else {
+            kept.push_back(pair);
+            kept_active.push_back(active);
+        }
+    }
+    
+    // drop dominated pairs
+    std::vector<RabinPair*> result;
+    std::vector<bool> removed(kept.size(), false);
+    for(int p = 0; p < kept.size(); p++){
+        for(int q = 0; q < kept.size(); q++){
+            if(q == p || removed[q])
+                continue;
+            if( kept[p]->infinite.is_subset_of(kept[q]->infinite)
+                && (kept[q]->finite & kept_active[p]).is_subset_of(kept[p]->finite) ){
+                removed[p] = true;
+                break;
+            }
+        }
+        if(removed[p])
+            delete kept[p];
+        else
+            result.push_back(kept[p]);
+    }
+    
+    this->pairs = result;
+    
+    if(verbose_output)
+        printf("Rabin pair reduction: %d pairs -> %d pairs\n", old_count, (int)this->pairs.size());
+    
+    return old_count - this->pairs.size();
+}
+
+/*
+ * Merge equivalent states with Hopcroft's algorithm. States are kept in
+ * @var elements, grouped so that each block occupies the range
+ * [block_start, block_end). Splitting a block moves the states which were
+ * marked to the front of its range and makes them a new block.
+ */
+int DRW::minimize(bool normalize_acceptance){
+    if(this->size <= 1)
+        return 0;
         
-        // build SCC's for (G \ FIN) 
-        BoostGraph g(this->size);
-        for(int i = 0; i < this->size; i++){
-            if(!this->pairs[p]->finite[i]){
-                for(int j = 0; j < this->alphabet_size; j++){
-                    int target = this->transition_matrix[i][j];
-                    if(!this->pairs[p]->finite[target])
-                        add_edge(i, target, g);
-                }
+    if(normalize_acceptance)
+        this->normalize_pairs();
+    
+    int n = this->size;
+    int k = this->alphabet_size;
+    
+    /* Initial partition: states with the same FIN/INF membership in every
+     * pair start out in the same block.
+     */
+    std::vector<int> block_of(n);
+    std::vector<int> block_start, block_end;
+    std::vector<int> elements(n), position(n);
+    {
+        boost::unordered_map<std::vector<bool>, int> signatures;
+        std::vector<int> block_count;
+        for(int i = 0; i < n; i++){
+            std::vector<bool> signature(2 * this->pairs.size());
+            for(int p = 0; p < this->pairs.size(); p++){
+                signature[2*p] = this->pairs[p]->finite[i];
+                signature[2*p+1] = this->pairs[p]->infinite[i];
+            }
+            boost::unordered_map<std::vector<bool>, int>::iterator loc = signatures.find(signature);
+            if(loc == signatures.end()){
+                block_of[i] = block_count.size();
+                signatures[signature] = block_count.size();
+                block_count.push_back(1);
+            } else {
+                block_of[i] = loc->second;
+                block_count[loc->second]++;
             }
         }
+        int start = 0;
+        for(int b = 0; b < block_count.size(); b++){
+            block_start.push_back(start);
+            block_end.push_back(start);
+            start += block_count[b];
+        }
+        for(int i = 0; i < n; i++){
+            int b = block_of[i];
+            elements[block_end[b]] = i;
+            position[i] = block_end[b];
+            block_end[b]++;
+        }
+    }
+    
+    /* Inverse transitions, stored by (character, target):
+     * the predecessors of t on a are 
+     * predecessors[pred_start[a*n + t] .. pred_start[a*n + t + 1]).
+     */
+    std::vector<int> pred_start(k * n + 1, 0);
+    std::vector<int> predecessors(k * n);
+    for(int i = 0; i < n; i++)
+        for(int a = 0; a < k; a++)
+            pred_start[a*n + this->transition(i, a) + 1]++;
+    for(int x = 0; x < k * n; x++)
+        pred_start[x+1] += pred_start[x];
+    {
+        std::vector<int> fill(pred_start.begin(), pred_start.end() - 1);
+        for(int i = 0; i < n; i++)
+            for(int a = 0; a < k; a++)
+                predecessors[fill[a*n + this->transition(i, a)]++] = i;
+    }
+    
+    /* Worklist of splitters (block, character). Every initial block except
+     * the largest one is enough.
+     */
+    std::vector<std::pair<int,int> > worklist;
+    std::vector<bool> in_worklist(block_start.size() * k, false);
+    {
+        int largest = 0;
+        for(int b = 1; b < block_start.size(); b++)
+            if(block_end[b] - block_start[b] > block_end[largest] - block_start[largest])
+                largest = b;
+        for(int b = 0; b < block_start.size(); b++){
+            if(b == largest) continue;
+            for(int a = 0; a < k; a++){
+                worklist.push_back(std::make_pair(b, a));
+                in_worklist[b*k + a] = true;
+            }
+        }
+    }
+    
+    std::vector<int> marked(block_start.size(), 0);
+    std::vector<int> touched;
+    std::vector<int> splitter;
+    
+    while(!worklist.empty()){
+        int b = worklist.back().first;
+        int a = worklist.back().second;
+        worklist.pop_back();
+        in_worklist[b*k + a] = false;
         
-        std::vector<int> sccs(num_vertices(g));
-        int num_sccs = strong_components(g, &sccs[0]);
-        bool nontrivial_component[num_sccs];
+        // copy the splitter, since marking may reorder its range
+        splitter.assign(elements.begin() + block_start[b], elements.begin() + block_end[b]);
         
-        for(int c = 0; c < num_sccs; c++)
-            nontrivial_component[c] = false;
+        // mark every state which moves into the splitter on a
+        for(int e = 0; e < splitter.size(); e++){
+            int t = splitter[e];
+            for(int x = pred_start[a*n + t]; x < pred_start[a*n + t + 1]; x++){
+                int s = predecessors[x];
+                int y = block_of[s];
+                if(marked[y] == 0)
+                    touched.push_back(y);
+                // swap s to the end of the marked prefix of its block
+                int target_pos = block_start[y] + marked[y];
+                int other = elements[target_pos];
+                elements[target_pos] = s;
+                elements[position[s]] = other;
+                position[other] = position[s];
+                position[s] = target_pos;
+                marked[y]++;
+            }
+        }
         
-        for(int i = 0; i < this->size; i++){
-            if(this->pairs[p]->infinite[i] && nontrivial_component[sccs[i]])
-                return false;
-            nontrivial_component[sccs[i]] = true;        
+        // split every block which was only partly marked
+        for(int t = 0; t < touched.size(); t++){
+            int y = touched[t];
+            int m = marked[y];
+            marked[y] = 0;
+            if(m == block_end[y] - block_start[y])
+                continue;
+                
+            int z = block_start.size();
+            block_start.push_back(block_start[y]);
+            block_end.push_back(block_start[y] + m);
+            block_start[y] += m;
+            marked.push_back(0);
+            for(int e = block_start[z]; e < block_end[z]; e++)
+                block_of[elements[e]] = z;
+                
+            in_worklist.resize(block_start.size() * k, false);
+            int smaller = (block_end[z] - block_start[z] <= block_end[y] - block_start[y]) ? z : y;
+            for(int c = 0; c < k; c++){
+                if(in_worklist[y*k + c]){
+                    worklist.push_back(std::make_pair(z, c));
+                    in_worklist[z*k + c] = true;
+                } else {
+                    worklist.push_back(std::make_pair(smaller, c));
+                    in_worklist[smaller*k + c] = true;
+                }
+            }
         }
-    }    
+        touched.clear();
+    }
     
-    return true;
+    int new_size = block_start.size();
+    if(new_size == n){
+        if(normalize_acceptance)
+            this->num_sccs = -1;
+        return 0;
+    }
+    
+    /* Number the blocks in order of their lowest state, so that the initial
+     * state of a determinized automaton (state 0) stays state 0.
+     */
+    std::vector<int> new_name(new_size, -1);
+    std::vector<int> representative;
+    for(int i = 0; i < n; i++){
+        if(new_name[block_of[i]] == -1){
+            new_name[block_of[i]] = representative.size();
+            representative.push_back(i);
+        }
+    }
+    
+    TransitionTable new_tm;
+    new_tm.resize(new_size, k);
+    for(int b = 0; b < new_size; b++){
+        for(int a = 0; a < k; a++)
+            new_tm.set(b, a, new_name[block_of[this->transition(representative[b], a)]]);
+    }
+    
+    for(int p = 0; p < this->pairs.size(); p++){
+        RabinPair* pair = new RabinPair(new_size);
+        for(int b = 0; b < new_size; b++){
+            if(this->pairs[p]->finite[representative[b]])
+                pair->finite.set(b);
+            if(this->pairs[p]->infinite[representative[b]])
+                pair->infinite.set(b);
+        }
+        delete this->pairs[p];
+        this->pairs[p] = pair;
+    }
+    
+    // keep the saved Safra trees (if any) in step with the states
+    if(SAVE_TREE_DATA && SafraTree::trees.size() == n){
+        std::vector<SafraTree*> new_trees;
+        for(int b = 0; b < new_size; b++)
+            new_trees.push_back(SafraTree::trees[representative[b]]);
+        SafraTree::trees = new_trees;
+    }
+    
+    this->transition_matrix.swap(new_tm);
+    this->initial_state = new_name[block_of[this->initial_state]];
+    this->size = new_size;
+    this->num_sccs = -1; // boost components are out of date
+    
+    if(verbose_output)
+        printf("DRW minimization: %d states -> %d states\n", n, new_size);
+    
+    return n - new_size;
 }
 
+/*
+ * Determine if the language of the automaton is empty: no reachable cycle
+ * satisfies a Rabin pair.
+ */
+bool DRW::is_empty(){
+    return !this->rabin_nonempty(this->reachable_states());
+}
 
 /*
- *  TODO: still completely borked.
  * Determine if the language of the automaton is universal.
-
  */
 bool DRW::is_universal(){
+    return !this->streett_nonempty(this->reachable_states());
+}
+
+/*
+ * The states reachable from the initial state.
+ */
+state_set_t DRW::reachable_states(){
+    state_set_t reached(this->size);
+    std::vector<int> work_queue;
+    reached.set(this->initial_state);
+    work_queue.push_back(this->initial_state);
+    while(!work_queue.empty()){
+        int q = work_queue.back();
+        work_queue.pop_back();
+        for(int a = 0; a < this->alphabet_size; a++){
+            int target = this->transition(q, a);
+            if(!reached[target]){
+                reached.set(target);
+                work_queue.push_back(target);
+            }
+        }
+    }
+    return reached;
+}
+
+/*
+ * Tarjan's algorithm on the subgraph induced by @param region, with an
+ * explicit call stack so that large automata do not overflow the stack.
+ * Only components which contain a cycle are returned.
+ */
+std::vector<state_set_t> DRW::cyclic_components(const state_set_t& region){
+    std::vector<state_set_t> ret;
+    std::vector<int> index(this->size, -1);
+    std::vector<int> lowlink(this->size, 0);
+    std::vector<bool> on_stack(this->size, false);
+    std::vector<int> stack;
+    std::vector< std::pair<int, int> > call_stack; // (state, next character)
+    int counter = 0;
+    
+    for(int root = region.find_first(); root >= 0 && root < this->size; root = region.find_next(root)){
+        if(index[root] != -1) continue;
+        index[root] = lowlink[root] = counter++;
+        stack.push_back(root);
+        on_stack[root] = true;
+        call_stack.push_back(std::make_pair(root, 0));
+        
+        while(!call_stack.empty()){
+            int v = call_stack.back().first;
+            if(call_stack.back().second < this->alphabet_size){
+                int w = this->transition(v, call_stack.back().second++);
+                if(!region[w]) continue;
+                if(index[w] == -1){
+                    index[w] = lowlink[w] = counter++;
+                    stack.push_back(w);
+                    on_stack[w] = true;
+                    call_stack.push_back(std::make_pair(w, 0));
+                } else if(on_stack[w]){
+                    lowlink[v] = std::min(lowlink[v], index[w]);
+                }
+                continue;
+            }
+            
+            // all successors of v are done
+            call_stack.pop_back();
+            if(!call_stack.empty()){
+                int u = call_stack.back().first;
+                lowlink[u] = std::min(lowlink[u], lowlink[v]);
+            }
+            if(lowlink[v] != index[v]) continue;
+            
+            // v is the root of a component: pop it off the stack
+            state_set_t component(this->size);
+            int members = 0;
+            int w;
+            do{
+                w = stack.back();
+                stack.pop_back();
+                on_stack[w] = false;
+                component.set(w);
+                members++;
+            } while(w != v);
+            
+            if(members > 1 || this->has_self_loop(v))
+                ret.push_back(component);
+        }
+    }
+    return ret;
+}
+
+/* Scan a row of the transition table for @param target.
+ */
+template<typename Index>
+static bool row_contains(const Index* row, int length, int target){
+    return std::find(row, row + length, (Index)target) != row + length;
+}
+
+bool DRW::has_self_loop(int state) const{
+    if(this->transition_matrix.is_wide())
+        return row_contains(this->transition_matrix.row<uint32_t>(state), this->alphabet_size, state);
+    else
+        return row_contains(this->transition_matrix.row<uint16_t>(state), this->alphabet_size, state);
+}
+
+/*
+ * Look for a cycle in @param region satisfying some Rabin pair.
+ * For a single pair this is Buchi emptiness on the graph without FIN, so
+ * each component of the region is refined once per pair that can still be
+ * satisfied in it. The pairs are independent and are checked in parallel;
+ * once one of them is satisfied the remaining workers skip their pairs.
+ */
+bool DRW::rabin_nonempty(const state_set_t& region){
+    std::vector<state_set_t> components = this->cyclic_components(region);
+    int num_pairs = this->pairs.size();
+    bool found = false;
+    
+    #pragma omp parallel for schedule(dynamic)
+    for(int p = 0; p < num_pairs; p++){
+        bool done;
+        #pragma omp atomic read
+        done = found;
+        if(done) continue;
+        
+        const RabinPair* pair = this->pairs[p];
+        bool satisfied = false;
+        for(int c = 0; c < components.size() && !satisfied; c++){
+            if(!pair->infinite.intersects(components[c]))
+                continue;
+            if(!pair->finite.intersects(components[c])){
+                satisfied = true;
+                break;
+            }
+            std::vector<state_set_t> refined = this->cyclic_components(components[c] - pair->finite);
+            for(int d = 0; d < refined.size() && !satisfied; d++)
+                if(pair->infinite.intersects(refined[d]))
+                    satisfied = true;
+        }
+        
+        if(satisfied){
+            #pragma omp atomic write
+            found = true;
+        }
+    }
+    return found;
+}
+
+/*
+ * Look for a cycle in @param region satisfying the Streett condition: for
+ * every pair, a cycle visiting INF must also visit FIN. In a component
+ * where some pair has INF states but no FIN states, those INF states cannot
+ * be on a good cycle; remove them and look at the smaller components.
+ * A component with no such pair is itself a good cycle.
+ */
+bool DRW::streett_nonempty(const state_set_t& region){
+    std::vector<state_set_t> work_queue = this->cyclic_components(region);
+    while(!work_queue.empty()){
+        state_set_t component = work_queue.back();
+        work_queue.pop_back();
+        
+        state_set_t bad(this->size);
+        for(int p = 0; p < this->pairs.size(); p++){
+            const RabinPair* pair = this->pairs[p];
+            if(!pair->finite.intersects(component))
+                bad |= pair->infinite;
+        }
+        bad &= component;
+        if(bad.none())
+            return true;
+        
+        std::vector<state_set_t> refined = this->cyclic_components(component - bad);
+        work_queue.insert(work_queue.end(), refined.begin(), refined.end());
+    }
     return false;
 }
         
+/***************** Successor functions for the complement construction ************/
+
+class DRW::StoredSuccessors{
+    const DRW& drw;
+    int num_pairs;
+    int initial_state;
+    
+    StoredSuccessors(const DRW& drw);
+    int target(int p, int a) { return this->drw.transition(p, a); }
+    const unsigned long* fin(int q) const { return &(this->drw.fin_masks[q * this->drw.pair_mask_words]); }
+    const unsigned long* inf(int q) const { return &(this->drw.inf_masks[q * this->drw.pair_mask_words]); }
+    
+    friend class DRW;
+};
+
+class DRW::SafraSuccessors{
+    const NBW& input;
+    int alphabet_size;
+    int num_pairs;
+    int words; // blocks per mask
+    int initial_state;
+    stree_set_t trees;
+    std::vector<SafraTree*> tree_list; // indexed by state
+    std::vector<int> targets; // -1 until the state is expanded
+    std::vector<unsigned long> fin_masks;
+    std::vector<unsigned long> inf_masks;
+    
+    SafraSuccessors(const NBW& input);
+    int add(SafraTree* tree);
+    void expand(int p);
+    int target(int p, int a) { 
+        if(this->targets[p * this->alphabet_size] == -1)
+            this->expand(p);
+        return this->targets[p * this->alphabet_size + a]; 
+    }
+    const unsigned long* fin(int q) const { return &(this->fin_masks[q * this->words]); }
+    const unsigned long* inf(int q) const { return &(this->inf_masks[q * this->words]); }
+    
+    friend class DRW;
+};
+
+
+/* Read the states, transitions and pair masks of a Rabin automaton which has
+ * already been built. build_pair_masks() must have been called.
+ */
+DRW::StoredSuccessors::StoredSuccessors(const DRW& drw) : drw(drw){
+    this->num_pairs = drw.pairs.size();
+    this->initial_state = drw.initial_state;
+}
+
+/* Build the Rabin automaton of Safra's construction state by state: the
+ * successors of a tree are only computed when the complement construction
+ * first asks for one of them. There is one pair per Safra node name, with
+ * FIN the trees where the name is unused and INF the trees where it is
+ * marked, as in NBW::determinize.
+ */
+DRW::SafraSuccessors::SafraSuccessors(const NBW& input) : input(input){
+    this->alphabet_size = input.alphabet_size;
+    this->num_pairs = 2 * input.size;
+    this->words = (this->num_pairs + 63) / 64;
+    if(this->words == 0) this->words = 1;
+    this->initial_state = this->add(SafraTree::build_initial_tree(input));
+}
+
+/* Give @param tree the next state number and compute its pair masks.
+ */
+int DRW::SafraSuccessors::add(SafraTree* tree){
+    tree->name = this->tree_list.size();
+    this->trees.insert(tree);
+    this->tree_list.push_back(tree);
+    this->targets.resize(this->targets.size() + this->alphabet_size, -1);
+    this->fin_masks.resize(this->fin_masks.size() + this->words, 0UL);
+    this->inf_masks.resize(this->inf_masks.size() + this->words, 0UL);
+    
+    unsigned long* fin = &(this->fin_masks[tree->name * this->words]);
+    unsigned long* inf = &(this->inf_masks[tree->name * this->words]);
+    for(int i = 0; i < this->num_pairs; i++){
+        if(tree->marked_nodes[i])
+            inf[i / 64] |= (1UL << (i % 64));
+        else if(!tree->used_node_names[i])
+            fin[i / 64] |= (1UL << (i % 64));
+    }
+    return tree->name;
+}
+
+/* Compute the successors of state @param p on every character, releasing
+ * the trees which turn out to be duplicates.
+ */
+void DRW::SafraSuccessors::expand(int p){
+    for(int a = 0; a < this->alphabet_size; a++){
+        SafraTree* result = SafraTree::get_transition(*this->tree_list[p], this->input, a+1);
+        stree_set_t::iterator loc = this->trees.find(result);
+        int target;
+        if(loc == this->trees.end()){
+            target = this->add(result);
+        } else {
+            target = (*loc)->name;
+            SafraTree::release(result);
+        }
+        this->targets[p * this->alphabet_size + a] = target;
+    }
+}
+
+
 /* 
  * Generate and return a Bchi automaton which accepts the complement 
  * of the language accepted by this automaton.
  */
 NBW* DRW::complement(){
+    this->build_pair_masks();
+    StoredSuccessors successors(*this);
+    return build_complement(successors, this->alphabet_size, this->char_labels);
+}
+
+/* 
+ * Complement the determinization of @param input without building the
+ * Rabin automaton first.
+ */
+NBW* DRW::lazy_complement(const NBW& input){
+    SafraSuccessors successors(input);
+    NBW* ret = build_complement(successors, input.alphabet_size, input.char_labels);
+    
+    /* As in NBW::determinize, keep the trees for debugging if asked to. */
+    SafraTree::trees = successors.tree_list;
+    if(!SAVE_TREE_DATA){
+        SafraTree::reset();
+    }
+    return ret;
+}
+
+/* 
+ * The complement construction. States (p,0,0) form a copy of the Rabin
+ * automaton (the initial part); from each of them the automaton may guess
+ * that no pair will be satisfied from now on, and move to (p,\0,\0).
+ */
+template<class Successors>
+NBW* DRW::build_complement(Successors& successors, int alphabet_size, const std::vector<std::string>& char_labels){
 
     std::vector< boost::tuple<int, int, int> > adjacency_list;
-    std::vector< CompState* > seen; // keep track of states we've seen
-    std::vector< CompState* > work_queue;
+    int num_pairs = successors.num_pairs;
+    CompStateTable seen(num_pairs); // keep track of states we've seen
+    std::vector<int> work_queue;
+    int words = seen.words;
 
     // add initial state
-    // note that states in the initial part (p,0,0) need no memory for statesets
-    CompState* initial = new CompState(0);
-    initial->rabin_state = this->initial_state;
-    initial->in_initial_part = true;
-    initial->buchi_index = 0;
-    work_queue.push_back(initial);
-    seen.push_back(initial);
+    // note that states in the initial part (p,0,0) leave their statesets empty
+    unsigned long* key = seen.candidate();
+    key[0] = ((unsigned long)successors.initial_state << 1) | 1;
+    bool added;
+    work_queue.push_back(seen.add(added));
         
     // calculate reachable part of automaton
     while(!work_queue.empty()){
-        std::vector<CompState*> new_work_queue;
+        std::vector<int> new_work_queue;
         int max = work_queue.size();
         
+        // every state has one successor per character, and states of the
+        // initial part have two; grow the buffer geometrically up front
+        std::size_t needed = adjacency_list.size() + 2 * max * alphabet_size;
+        if(adjacency_list.capacity() < needed)
+            adjacency_list.reserve(std::max(needed, 2 * adjacency_list.capacity()));
+        
         for(int i = 0; i < max; i++){
-            CompState* current = work_queue[i];
-            for(int a = 0; a < this->alphabet_size; a++){
-                int q = this->transition_matrix[work_queue[i]->rabin_state][a];
-                if(current->in_initial_part){
+            int current = work_queue[i];
+            int p = seen.rabin_state(current);
+            bool in_initial_part = seen.in_initial_part(current);
+            for(int a = 0; a < alphabet_size; a++){
+                int q = successors.target(p, a);
+                if(in_initial_part){
                     // (p,0,0) -a-> (q,0,0)
-                    CompState* next_state = new CompState(0);
-                    next_state->rabin_state = q;
-                    next_state->in_initial_part = true;
-                    int index = next_state->get_index(seen);
-                    if(index == -1){
-                        new_work_queue.push_back(next_state);
-                        index = next_state->buchi_index;
-                    } else {
-                        delete next_state; // clean up extra object
-                        next_state = seen[index];
-                    }
-                    adjacency_list.push_back(boost::make_tuple(work_queue[i]->buchi_index, a, index));
+                    key = seen.candidate();
+                    key[0] = ((unsigned long)q << 1) | 1;
+                    int index = seen.add(added);
+                    if(added)
+                        new_work_queue.push_back(index);
+                    adjacency_list.push_back(boost::make_tuple(current, a, index));
                     
                     // (p,0,0) -a-> (q,\0,\0)
-                    next_state = new CompState(this->pairs.size());
-                    next_state->rabin_state = q;
-                    next_state->in_initial_part = false;
-                    index = next_state->get_index(seen);
-                    if(index == -1){
-                        new_work_queue.push_back(next_state);
-                        index = next_state->buchi_index;
-                    } else {
-                        delete next_state; // clean up extra object
-                        next_state = seen[index];
-                    }
-                    adjacency_list.push_back(boost::make_tuple(work_queue[i]->buchi_index, a, index));                    
+                    key = seen.candidate();
+                    key[0] = ((unsigned long)q << 1);
+                    index = seen.add(added);
+                    if(added)
+                        new_work_queue.push_back(index);
+                    adjacency_list.push_back(boost::make_tuple(current, a, index));                    
                 
                 } else {
                     // (p,s1,s2) -a-> (q,s1',s2')
@@ -432,41 +1056,37 @@ NBW* DRW::complement(){
                     // and s1 hits cancel s2 hits (leaving the pair unsatisfied).
                     // Since a state is final if s2 is empty, the complement
                     // machine must keep all pairs unsatisfied forever
-                    CompState* next_state = new CompState(this->pairs.size());
-                    next_state->rabin_state = q;
-                    next_state->in_initial_part = false;
-                    next_state->s1 = state_set_t( current->s1 );
-                    next_state->s2 = state_set_t( current->s2 );
-                    
-                    for(int pair = 0; pair < this->pairs.size(); pair++){
-                        if(this->pairs[pair]->finite[q])
-                            next_state->s1.set(pair);
-                        else if(this->pairs[pair]->infinite[q])
-                            next_state->s2.set(pair);
+                    key = seen.candidate();
+                    const unsigned long* from = seen.key(current);
+                    const unsigned long* fin = successors.fin(q);
+                    const unsigned long* inf = successors.inf(q);
+                    key[0] = ((unsigned long)q << 1);
+                    unsigned long* s1 = key + 1;
+                    unsigned long* s2 = key + 1 + words;
+                    for(int w = 0; w < words; w++){
+                        s1[w] = from[1 + w] | fin[w];
+                        s2[w] = from[1 + words + w] | inf[w];
                     }
                     
-                    if(next_state->s2.is_subset_of(next_state->s1)){
-                        next_state->s1 -= next_state->s2;
-                        next_state->s2.reset();   
+                    bool s2_in_s1 = true;
+                    for(int w = 0; w < words; w++)
+                        if(s2[w] & ~s1[w]) s2_in_s1 = false;
+                    if(s2_in_s1){
+                        for(int w = 0; w < words; w++){
+                            s1[w] &= ~s2[w];
+                            s2[w] = 0;
+                        }
                     }
                     
-                    int index = next_state->get_index(seen);                    
-                    
-                    if(index == -1){
-                        new_work_queue.push_back(next_state);
-                        index = next_state->buchi_index;
-                    } else {
-                        delete next_state; // clean up extra object
-                        next_state = seen[index];
-                    }               
-
-                    adjacency_list.push_back(boost::make_tuple(work_queue[i]->buchi_index, a, next_state->buchi_index));                                        
+                    int index = seen.add(added);
+                    if(added)
+                        new_work_queue.push_back(index);
 
-                
+                    adjacency_list.push_back(boost::make_tuple(current, a, index));                                        
                 }    
             } // end for each character in the alphabet
         } // end for each state in the work queue
-        work_queue = new_work_queue;
+        work_queue.swap(new_work_queue);
         
     } // end calculating reachable part of new automaton
     
@@ -474,30 +1094,36 @@ NBW* DRW::complement(){
     /* We have finished calculating the adjacency list; 
        now calculate the rest of the data to build the automaton. */    
         
-    int nbw_size = seen.size();
-    int nbw_alphabet_size = this->alphabet_size;
-    int num_transitions = adjacency_list.size();
+    int nbw_size = seen.count;
+    int nbw_alphabet_size = alphabet_size;
     
     // copy character semantics table
-    std::vector<std::string> nbw_char_labels(this->char_labels);
+    std::vector<std::string> nbw_char_labels(char_labels);
     
     // Create a state semantics table (state labels) corresponding
     // to the complementation procedure we used.
     std::vector<std::string> nbw_state_labels;
+    nbw_state_labels.reserve(nbw_size);
     
     for(int i = 0; i < nbw_size; i++){        
-        if(seen[i]->in_initial_part){
+        if(seen.in_initial_part(i)){
             std::string label("(");
-            label += INT_TO_STR(seen[i]->rabin_state + 1);
+            label += INT_TO_STR(seen.rabin_state(i) + 1);
             label += ", initial)";
             nbw_state_labels.push_back(label);
         } else {
             std::string label("(");
-            label += INT_TO_STR(seen[i]->rabin_state + 1);
+            label += INT_TO_STR(seen.rabin_state(i) + 1);
             label += ",";
-            std::string s1; std::string s2;
-            boost::to_string(seen[i]->s1, s1);
-            boost::to_string(seen[i]->s2, s2);
+            // most significant pair first, as boost::to_string prints bitsets
+            const unsigned long* k = seen.key(i);
+            std::string s1(num_pairs, '0'); std::string s2(num_pairs, '0');
+            for(int pair = 0; pair < num_pairs; pair++){
+                if(k[1 + pair / 64] & (1UL << (pair % 64)))
+                    s1[num_pairs - 1 - pair] = '1';
+                if(k[1 + words + pair / 64] & (1UL << (pair % 64)))
+                    s2[num_pairs - 1 - pair] = '1';
+            }
             label += (s1 + "," + s2 + ")");
             nbw_state_labels.push_back(label);    
         }
@@ -509,19 +1135,20 @@ NBW* DRW::complement(){
     nbw_initial.set(0);
 
     state_set_t nbw_final(nbw_size);
-    for(int i = 0; i < nbw_size; i++){ //(ret->size = seen.size())
-        if(!seen[i]->in_initial_part){
-            if(seen[i]->s2.none()){
+    for(int i = 0; i < nbw_size; i++){
+        if(!seen.in_initial_part(i)){
+            const unsigned long* s2 = seen.key(i) + 1 + words;
+            bool s2_empty = true;
+            for(int w = 0; w < words; w++)
+                if(s2[w]) s2_empty = false;
+            if(s2_empty)
                 nbw_final.set(i);
-            }
         }
     }
     
-    // Delete CompStates to free memory
-    for(int i = 0; i < seen.size(); i++)
-        delete seen[i];
-    
-    NBW* ret = new NBW(nbw_size, 
+    // Most complement states cannot reach an accepting cycle; leave them
+    // out instead of building the full automaton and trimming it.
+    NBW* ret = NBW::build_trimmed(nbw_size, 
                    nbw_alphabet_size, 
                    adjacency_list,
                    nbw_initial,
@@ -533,35 +1160,50 @@ NBW* DRW::complement(){
 }
 
 
-/***************** Implementation of private class CompState ************/
+/***************** Implementation of private class CompStateTable ************/
 /* Used in DRW::complement to build states of a Buchi automaton accepting
  * the complement of the language
  */
 
-DRW::CompState::CompState(int state_set_size){
-    this->s1.resize(state_set_size);
-    this->s2.resize(state_set_size);
+DRW::CompStateTable::CompStateTable(int num_pairs)
+    : index(64, key_hash_t(this), key_eq_t(this)){
+    this->words = (num_pairs + 63) / 64;
+    if(this->words == 0) this->words = 1;
+    this->stride = 1 + 2 * this->words;
+    this->count = 0;
 }
 
-/** Simple equality check -- if all the fields are equal they are equal.
+/** Hash the blocks of the key stored at the given index.
  */
-bool DRW::CompState::operator==(const CompState& other){
-    return (this->rabin_state == other.rabin_state) 
-        && (this->in_initial_part == other.in_initial_part)
-        && (this->in_initial_part || ((this->s1 == other.s1) && (this->s2 == other.s2)));
+std::size_t DRW::CompStateTable::key_hash_t::operator()(int index) const {
+    const unsigned long* k = &(table->keys[index * table->stride]);
+    return boost::hash_range(k, k + table->stride);
 }
 
-/** Get the index of an equivalent CompState in the vector, 
- *  if it is in the vector at all.
- *  Returning -1 indicates that we just added it... you should retrieve the new
- *  reference. Returning any other value indicates that it is a redundant object...
- *  you should delete this object.
+/** Simple equality check -- if all the blocks are equal they are equal.
  */
-int DRW::CompState::get_index(std::vector<CompState*>& seen){
-    for(int i = 0; i < seen.size(); i++)
-        if(*(seen[i]) == *(this))        
-            return i;
-    this->buchi_index = seen.size();
-    seen.push_back(this);
-    return -1;
-}
\ No newline at end of file
+bool DRW::CompStateTable::key_eq_t::operator()(int x, int y) const {
+    const unsigned long* kx = &(table->keys[x * table->stride]);
+    const unsigned long* ky = &(table->keys[y * table->stride]);
+    return std::equal(kx, kx + table->stride, ky);
+}
+
+unsigned long* DRW::CompStateTable::candidate(){
+    this->keys.resize((this->count + 1) * this->stride);
+    unsigned long* k = this->key(this->count);
+    std::fill(k, k + this->stride, 0UL);
+    return k;
+}
+
+/** Get the index of the state equal to the candidate.
+ *  If there is none, the candidate is kept and count is incremented;
+ *  otherwise its blocks are reused by the next call to candidate().
+ */
+int DRW::CompStateTable::add(bool& added){
+    std::pair<boost::unordered_set<int, key_hash_t, key_eq_t>::iterator, bool> result 
+        = this->index.insert(this->count);
+    added = result.second;
+    if(added)
+        this->count++;
+    return *(result.first);
+}
@@ -12,9 +12,68 @@
 #include <string>
 #include <vector>
 
+#include <stdint.h>
+
+#include <boost/unordered_set.hpp>
+
 #include "utils.hpp" // for special types
 #include "SafraTree.hpp" // to see safra trees for to_GASt_string()
 
+/**
+ * The transitions of a deterministic automaton, stored row-major in a single
+ * buffer: the target of state X on character C is entry X*alphabet_size + C.
+ * Entries are 16 bits wide when the automaton has at most 65536 states and
+ * 32 bits wide otherwise, so that large tables stay small in cache.
+ */
+class TransitionTable{
+    private:
+        int alphabet_size;
+        bool wide;
+        std::vector<uint16_t> narrow_entries;
+        std::vector<uint32_t> wide_entries;
+        
+    public:
+        TransitionTable();
+        
+        /* Allocate a table for @param states states over @param alphabet_size
+         * characters, discarding the old contents. Every entry is 0.
+         */
+        void resize(int states, int alphabet_size);
+        
+        void swap(TransitionTable& other);
+        
+        int get(int state, int character) const {
+            std::size_t i = (std::size_t)state * this->alphabet_size + character;
+            return this->wide ? (int)this->wide_entries[i] : (int)this->narrow_entries[i];
+        }
+        
+        void set(int state, int character, int target){
+            std::size_t i = (std::size_t)state * this->alphabet_size + character;
+            if(this->wide) 
+                this->wide_entries[i] = target;
+            else 
+                this->narrow_entries[i] = target;
+        }
+        
+        /* True if the entries are 32 bits wide (uint32_t), false if they are
+         * 16 bits wide (uint16_t).
+         */
+        bool is_wide() const { return this->wide; }
+        
+        /* The alphabet_size targets of @param state, for scanning a whole row
+         * at once. Index must match the width reported by is_wide().
+         */
+        template<typename Index> const Index* row(int state) const;
+};
+
+template<> inline const uint16_t* TransitionTable::row<uint16_t>(int state) const {
+    return &(this->narrow_entries[(std::size_t)state * this->alphabet_size]);
+}
+
+template<> inline const uint32_t* TransitionTable::row<uint32_t>(int state) const {
+    return &(this->wide_entries[(std::size_t)state * this->alphabet_size]);
+}
+
 class DRW{
     private:
     
@@ -49,26 +108,127 @@ class DRW{
          */
         void build_boost_components();
         
+        /* The Rabin pairs, stored by state instead of by pair: the FIN and
+         * INF masks of state X are the pair_mask_words blocks starting at
+         * X*pair_mask_words, with bit P set if state X is in FIN (INF) of
+         * pair P. A state in both sets of a pair only has its FIN bit set,
+         * since hitting FIN cancels the pair anyway.
+         * Like the Boost fields, these are not reliable until generated with
+         * build_pair_masks; the pair-major RabinPair sets remain the
+         * authoritative copy.
+         */
+        int pair_mask_words;
+        std::vector<unsigned long> fin_masks;
+        std::vector<unsigned long> inf_masks;
+        
+        void build_pair_masks();
+        
+        /*
+         * Rewrite the Rabin pairs into an equivalent but more uniform form,
+         * so that minimize() can merge more states. States which are not on
+         * any cycle are removed from every pair (they are visited at most
+         * once, so they cannot affect acceptance), and inside each strongly
+         * connected component a pair whose INF set misses the component has
+         * its FIN set cleared there (the pair cannot be satisfied there).
+         */
+        void normalize_pairs();
+        
+        /* The states which lie on a cycle (in a strongly connected component
+         * with more than one state, or with a self-loop).
+         */
+        state_set_t cyclic_states();
+        
+        /* The states of @param cyclic which are in a component where
+         * @param pair can be satisfied (one containing a state of its INF set).
+         */
+        state_set_t active_states(const RabinPair& pair, const state_set_t& cyclic);
+        
+        /* The states reachable from the initial state.
+         */
+        state_set_t reachable_states();
+        
+        /* The strongly connected components of the subgraph induced by
+         * @param region which contain a cycle, computed with an iterative
+         * version of Tarjan's algorithm directly on the transition matrix.
+         */
+        std::vector<state_set_t> cyclic_components(const state_set_t& region);
+        
+        /* True if some character leads from @param state back to itself.
+         */
+        bool has_self_loop(int state) const;
+        
+        /* Emerson-Lei style emptiness checks. Each looks for a cycle inside
+         * @param region whose set of states satisfies the acceptance condition,
+         * computing the components of the region once and then refining only
+         * inside components which are still candidates.
+         * Rabin: some pair (FIN, INF) has FIN unvisited and INF visited.
+         * Streett: for every pair, if INF is visited then FIN is visited;
+         * this is the condition of the runs which the Rabin pairs reject.
+         */
+        bool rabin_nonempty(const state_set_t& region);
+        bool streett_nonempty(const state_set_t& region);
+        
         
         /*
          * Used to construct the states of the complemented Rabin automaton.
+         * A state (rabin_state, in_initial_part, s1, s2) is packed into a key
+         * of 1 + 2*words blocks: the first block holds the Rabin state and
+         * the initial flag, followed by s1 (finite rabin pairs hit) and s2
+         * (infinite rabin pairs hit). When there are at most 64 pairs each
+         * set fits in a single block. The keys of all states are stored back
+         * to back, so a state is identified by its index in the complement,
+         * and a hash set over the indices finds duplicates in constant time.
          */
-        class CompState{
-            int rabin_state;
-            bool in_initial_part; // the bool value is true if this state is part of the initial transition system
-            state_set_t s1; // finite rabin pairs hit
-            state_set_t s2; // infinite rabin pairs hit
+        class CompStateTable{
+            /* Hash and equality on the key stored at an index. */
+            struct key_hash_t{
+                const CompStateTable* table;
+                key_hash_t(const CompStateTable* t) : table(t) {}
+                std::size_t operator()(int index) const;
+            };
+            struct key_eq_t{
+                const CompStateTable* table;
+                key_eq_t(const CompStateTable* t) : table(t) {}
+                bool operator()(int x, int y) const;
+            };
             
-            int buchi_index; // can be used to cache the index in the buchi automaton
+            int words; // blocks per set of pairs
+            int stride; // blocks per key
+            int count; // number of states stored
+            std::vector<unsigned long> keys;
+            boost::unordered_set<int, key_hash_t, key_eq_t> index;
             
-            CompState(int state_set_size);
-            bool operator==(const CompState& other);
+            CompStateTable(int num_pairs);
             
             /* Methods: */
-            int get_index(std::vector<CompState*>& seen);
+            unsigned long* key(int i) { return &(this->keys[i * this->stride]); }
+            int rabin_state(int i) const { return (int)(this->keys[i * this->stride] >> 1); }
+            bool in_initial_part(int i) const { return this->keys[i * this->stride] & 1; }
+            
+            /* Clear the key at index count and return it, so the caller can
+             * fill in a candidate state before calling add().
+             */
+            unsigned long* candidate();
+            
+            /* Look up the candidate state and return its index. @param added
+             * is set to true if the candidate was new and has been kept.
+             */
+            int add(bool& added);
             
             friend class DRW; // DRW has no special access privileges otherwise
         };
+        
+        /*
+         * Successor functions for the complement construction: the initial
+         * state, the transitions and the per-state pair masks of a Rabin
+         * automaton. StoredSuccessors reads them from a DRW which has been
+         * built; SafraSuccessors computes them from Safra trees on demand.
+         */
+        class StoredSuccessors;
+        class SafraSuccessors;
+        
+        template<class Successors>
+        static NBW* build_complement(Successors& successors, int alphabet_size, const std::vector<std::string>& char_labels);
     
     public:
     
@@ -105,9 +265,9 @@ class DRW{
         /**
          * The transition matrix.
          * State X transitions on character C to the state stored at 
-         * transition_matrix[X-1][C-1].
+         * transition_matrix.get(X, C) (both counted from 0).
          */
-        std::vector<int*> transition_matrix;
+        TransitionTable transition_matrix;
 
         /*
          * Read a Rabin automaton from a text file.
@@ -118,11 +278,12 @@ class DRW{
         static DRW* parse(char* filename);        
 
         
-        /* Return the transition from @param state on @param character.
-         * May be useful for data encapuslation in the future (if for example
-         * the transition matrix is stored in a different form).
+        /* Return the transition from @param state on @param character
+         * (both counted from 0).
          */
-        int transition(int state, int character) const;
+        int transition(int state, int character) const {
+            return this->transition_matrix.get(state, character);
+        }
         
         /** Generate a printable version of this automaton.
          */
@@ -145,32 +306,25 @@ class DRW{
         
         /*
          * Determine if the language of the automaton is empty.
-         * Assumes that every state is reachable since Safra's construction only builds
-         * the reachable part of the Rabin automaton.
          * Uses the following algorithm to check emptiness -- suppose that the Rabin 
          * pairs are given as (FIN, INF).
-         *    For each Rabin acceptance pair, see if that pair can be satisfied:
-         *      A state in INF with a path to itself which does not pass through
-         *      any states in FIN is required to satisfy the pair.
-         *    If the pair can be satisfied, the automaton is not empty.
-         * Uses BGL implementation of Tarjan's algorithm to identify strongly connected
-         * components.
+         *    Compute the strongly connected components of the reachable states.
+         *    For each component C and each pair with a state of INF in C, 
+         *    find the components of C \ FIN: if one of them contains a state
+         *    of INF, the pair can be satisfied and the automaton is not empty.
+         * Runs in O(pairs * transitions).
          */
         bool is_empty();
         
         /*
          * Determine if the language of the automaton is universal.
-         * Assumes that every state is reachable since Safra's construction only builds
-         * the reachable part of the Rabin automaton.
-         * Uses the following algorithm to check universality -- suppose that the Rabin 
-         * pairs are given as (FIN, INF). We actually look for not-universal: see if 
-         * there is a way to fail (not satisfy) any pair. Thus our algorithm is this:
-         *    For each Rabin acceptance pair, see if that pair can be failed:
-         *      A state in FIN with a path to itself which does not pass through
-         *      any states in INF makes it possible to fail the pair.
-         *    If no pair can be failed, the automaton is universal.
-         * Uses BGL implementation of Tarjan's algorithm to identify strongly connected
-         * components.
+         * Since the automaton is deterministic and complete, every reachable
+         * cycle is the run on some word, so the automaton is universal unless
+         * some reachable cycle fails every pair: whenever it visits INF it
+         * also visits FIN. That is the Streett condition on the same pairs;
+         * we look for such a cycle recursively: in a component C, states of
+         * INF for pairs whose FIN misses C can never be visited, so remove
+         * them and recurse on the components of what is left.
          */
         bool is_universal();
                 
@@ -179,12 +333,43 @@ class DRW{
          */
         void print_components();
         
+        /*
+         * Merge equivalent states using Hopcroft's partition refinement.
+         * The initial partition groups states with identical membership in
+         * the FIN and INF sets of every Rabin pair; blocks are then split
+         * until states in the same block go to the same block on every
+         * character. If @param normalize_acceptance is true, the pairs are
+         * first rewritten with normalize_pairs(), which gives a coarser
+         * initial partition without changing the language.
+         * Returns the number of states saved (old size - new size).
+         */
+        int minimize(bool normalize_acceptance = false);
+        
+        /*
+         * Shrink the list of Rabin pairs without changing the language:
+         * remove pairs which cannot be satisfied on any cycle, merge pairs
+         * which agree on every strongly connected component where both can
+         * be satisfied, and drop pairs dominated by another pair.
+         * The complement construction is exponential in the number of
+         * pairs, so this should be run before complement().
+         * Returns the number of pairs removed.
+         */
+        int reduce_pairs();
+        
         /* 
          * Generate and return a Bchi automaton which accepts the complement 
          * of the language accepted by this automaton.
          */
         NBW* complement();
         
+        /*
+         * Generate a Bchi automaton which accepts the complement of the
+         * language of @param input, exploring Safra's construction only as
+         * far as the complement construction asks for it; no Rabin
+         * automaton is built. @param input should be trimmed.
+         */
+        static NBW* lazy_complement(const NBW& input);
+        
         DRW();
         ~DRW();
 };
@@ -11,15 +11,18 @@
 
 /* Include string IO + stream utilities for tokenizing input files */
 #include <string.h>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iterator>
 
 /* OpenMP library for parallel operations */
 #include <omp.h>
 
 #include <iomanip> // TODO: remove; used for debugging ouput only
 
+#include <boost/unordered_map.hpp>
 #include <boost/unordered_set.hpp>
 #include <boost/graph/strong_components.hpp>
 #include <boost/graph/reverse_graph.hpp>
@@ -30,11 +33,6 @@
 
 #include "SafraTree.hpp"
 
-/**
- * Hash set type used for hashing SafraTrees.
- */
-typedef boost::unordered_set<SafraTree*, stp_hash_t, stp_eq_t> stree_set_t;
-
 NBW* NBW::parse_from_GASt(std::istream &input, std::string &buffer){
     using namespace std;
     NBW* ret = new NBW();
@@ -391,7 +389,7 @@ NBW::NBW(){
  */
 NBW::NBW(int size, 
         int alphabet_size, 
-        std::vector<boost::tuple<int, int,int> > adjacency_list,
+        const std::vector<boost::tuple<int, int,int> >& adjacency_list,
         state_set_t initial,
         state_set_t final,
         std::vector<std::string> char_labels,
@@ -445,6 +443,149 @@ NBW::NBW(int size,
     
 } // end NBW(...) -- transition list constructor
 
+/** Build an automaton from an adjacency list, keeping only the states which
+ * are accessible and coaccessible, numbered in their original order. Like
+ * trim(), an automaton with no such states becomes a single empty state.
+ */
+NBW* NBW::build_trimmed(int size, 
+        int alphabet_size, 
+        const std::vector<boost::tuple<int, int,int> >& adjacency_list,
+        const state_set_t& initial,
+        const state_set_t& final,
+        const std::vector<std::string>& char_labels,
+        const std::vector<std::string>& state_labels){
+    
+    if(size <= 1){
+        return new NBW(size, alphabet_size, adjacency_list, initial, final, char_labels, state_labels);
+    }
+    
+    // successor and predecessor lists, ignoring characters
+    std::vector< std::vector<int> > successors(size);
+    std::vector< std::vector<int> > predecessors(size);
+    BoostGraph g(size);
+    for(int i = 0; i < adjacency_list.size(); i++){
+        int s1 = adjacency_list[i].get<0>();
+        int s2 = adjacency_list[i].get<2>();
+        successors[s1].push_back(s2);
+        predecessors[s2].push_back(s1);
+        boost::add_edge(s1, s2, g);
+    }
+    
+    // accessible: forward search from the initial states
+    state_set_t accessible(initial);
+    std::vector<int> search_queue;
+    for(int i = 0; i < size; i++)
+        if(initial[i])
+            search_queue.push_back(i);
+    for(int i = 0; i < search_queue.size(); i++){
+        for(int j = 0; j < successors[search_queue[i]].size(); j++){
+            int target = successors[search_queue[i]][j];
+            if(!accessible[target]){
+                accessible.set(target);
+                search_queue.push_back(target);
+            }
+        }
+    }
+    
+    // coaccessible: backward search from the final states on a cycle
+    std::vector<int> sccs(size);
+    boost::strong_components(g, &sccs[0]);
+    std::vector<int> component_size(size, 0);
+    for(int i = 0; i < size; i++)
+        component_size[sccs[i]]++;
+    
+    state_set_t coaccessible(size);
+    search_queue.clear();
+    for(int i = 0; i < size; i++){
+        if(!final[i]) continue;
+        bool on_cycle = (component_size[sccs[i]] > 1);
+        for(int j = 0; j < successors[i].size() && !on_cycle; j++)
+            if(successors[i][j] == i)
+                on_cycle = true;
+        if(on_cycle){
+            coaccessible.set(i);
+            search_queue.push_back(i);
+        }
+    }
+    for(int i = 0; i < search_queue.size(); i++){
+        for(int j = 0; j < predecessors[search_queue[i]].size(); j++){
+            int source = predecessors[search_queue[i]][j];
+            if(!coaccessible[source]){
+                coaccessible.set(source);
+                search_queue.push_back(source);
+            }
+        }
+    }
+    
+    state_set_t keep = accessible & coaccessible;
+    int new_size = keep.count();
+    NBW* ret;
+    
+    if(new_size == 0){
+        // the language is empty: a single state with no transitions
+        state_set_t new_initial(1);
+        new_initial.set(0);
+        ret = new NBW(1, alphabet_size, std::vector<boost::tuple<int, int, int> >(), 
+                      new_initial, state_set_t(1), char_labels);
+    } else {
+        std::vector<int> new_label(size, -1);
+        state_set_t new_initial(new_size);
+        state_set_t new_final(new_size);
+        std::vector<std::string> new_state_labels;
+        for(int i = 0, j = 0; i < size; i++){
+            if(!keep[i]) continue;
+            new_label[i] = j;
+            if(initial[i]) new_initial.set(j);
+            if(final[i]) new_final.set(j);
+            if(state_labels.size() > 0)
+                new_state_labels.push_back(state_labels[i]);
+            j++;
+        }
+        
+        std::vector<boost::tuple<int, int, int> > new_adjacency_list;
+        for(int i = 0; i < adjacency_list.size(); i++){
+            int s1 = new_label[adjacency_list[i].get<0>()];
+            int s2 = new_label[adjacency_list[i].get<2>()];
+            if(s1 >= 0 && s2 >= 0)
+                new_adjacency_list.push_back(boost::make_tuple(s1, adjacency_list[i].get<1>(), s2));
+        }
+        
+        ret = new NBW(new_size, alphabet_size, new_adjacency_list, 
+                      new_initial, new_final, char_labels, new_state_labels);
+    }
+    
+    ret->trimmed = true;
+    return ret;
+} // end NBW::build_trimmed(...)
+
+NBW* NBW::copy() const{
+    NBW* ret = new NBW();
+    ret->size = this->size;
+    ret->alphabet_size = this->alphabet_size;
+    ret->num_transitions = this->num_transitions;
+    ret->trimmed = this->trimmed;
+    ret->alphabet = this->alphabet;
+    ret->char_labels = this->char_labels;
+    ret->state_labels = this->state_labels;
+    ret->track_vars = this->track_vars;
+    ret->projected_tracks = this->projected_tracks;
+    ret->initial = this->initial;
+    ret->final = this->final;
+    
+    ret->transition_matrix = new state_set_t[ (ret->alphabet_size) * (ret->size)];
+    for(int i = 0; i < (ret->alphabet_size)*(ret->size); i++)
+        ret->transition_matrix[i] = this->transition_matrix[i];
+    
+    ret->use_cache = this->use_cache;
+    if(ret->use_cache){
+        int cache_size = (ret->alphabet_size) * (1<<(ret->size));
+        ret->transition_cache = new state_set_t[cache_size];
+        for(int i = 0; i < cache_size; i++)
+            ret->transition_cache[i] = this->transition_cache[i];
+    }
+    return ret;
+} // end NBW* NBW::copy() const
+
 NBW::~NBW(){
     // delete the transition matrix
     delete [] this->transition_matrix;
@@ -508,21 +649,15 @@ DRW* NBW::determinize() const{
         return ret;
     }
 
-    ret->transition_matrix.push_back(new int[ret->alphabet_size]);
-
-    //double stime = 0.0;
-    //double ptime = 0.0;
-
-    
     // create initial state
     SafraTree* initial_state = SafraTree::build_initial_tree(*this);
     trees.insert(initial_state);
     tree_list.push_back(initial_state);
     
-    // add initial work units
-    for(int i = 1; i <= this->alphabet_size; i++)
-        work_queue.push_back(initial_state);
+    // add initial work unit
+    work_queue.push_back(initial_state);
     
+    int level = 0;
     while( !work_queue.empty() ){
         if( ((work_queue.size() + tree_list.size()) * this->alphabet_size) > 10000){
             int x = tree_list.size();
@@ -536,28 +671,23 @@ DRW* NBW::determinize() const{
         vector<SafraTree*> new_work_queue;
         
         int max = work_queue.size();
-
-        //double parallel_start = omp_get_wtime();
-
-        // ----------- TRANSITION -----------
-        //#pragma omp parallel for
-        for(int i = 0; i < max; i++){
-            for(int j = 0; j < this->alphabet_size; j++){
-            // perform transition
-                work_queue[i]->targets[j] = SafraTree::get_transition(*work_queue[i], *this, j+1);
-            }
-        }
-
-        //double parallel_end = omp_get_wtime();
-        //ptime += (parallel_end - parallel_start); 
         
-//        #pragma omp barrier
-        //double serial_start = omp_get_wtime();
-        
-        // --- reduce (name states) ---
+        /* Counts of the trees built on this level which turned out to be new
+         * states, and those which duplicated a state we had already seen.
+         */
+        int level_new = 0;
+        int level_duplicates = 0;
+
+        /* ----------- TRANSITION + REDUCE (name states) -----------
+         * Each tree is looked up as soon as it is built. Duplicates typically
+         * outnumber new states by about |alphabet| to 1, so they are released
+         * immediately rather than being held until SafraTree::reset(); this
+         * keeps the peak memory use close to the size of the final DRW.
+         */
         for(int i = 0; i < max; i++){
             for(int j = 0; j < this->alphabet_size; j++){
-                SafraTree* result = work_queue[i]->targets[j];
+                // perform transition
+                SafraTree* result = SafraTree::get_transition(*work_queue[i], *this, j+1);
                 
                 stree_set_t::iterator loc = trees.find(result);            
                 
@@ -566,42 +696,45 @@ DRW* NBW::determinize() const{
                     tree_list.push_back(result);
                     trees.insert(loc, result);
                     new_work_queue.push_back(result);
-                } else if (result->treeID != (*loc)->treeID) { // tree already reached.
+                    work_queue[i]->targets[j] = result;
+                    level_new++;
+                } else { // tree already reached.
                     work_queue[i]->targets[j] = *loc; //canonicalize reference
+                    SafraTree::release(result);
+                    level_duplicates++;
                 }  
             }
         }
+        
+        if(verbose_output)
+            printf("Safra level %d: %d new states, %d duplicates released\n", 
+                   level, level_new, level_duplicates);
+        level++;
                 
-        //work_queue.clear();
         work_queue = new_work_queue;
-        //new_work_queue.clear();
-        
-        //double serial_end = omp_get_wtime();
-        //stime += (serial_end - serial_start); 
     }
     
-    //cout << "   Parallel region used " << setiosflags(ios::fixed) << setprecision(4) << ptime << " s." << endl;
-    //cout << "   Serial region used " << setiosflags(ios::fixed) << setprecision(4) << stime << " s." << endl;
-    
     ret->size = trees.size();
 
 
     /* convert the network of trees to a transition matrix */
     int max = tree_list.size();
-    for(int i = 0; i < max; i++){
-        ret->transition_matrix.push_back(new int[ret->alphabet_size]);
-    }
+    ret->transition_matrix.resize(max, ret->alphabet_size);
     
     //#pragma omp parallel for
     for(int i = 0; i < max; i++){
         for(int j = 0; j < ret->alphabet_size; j++)
-            ret->transition_matrix[i][j] = tree_list[i]->targets[j]->name;
+            ret->transition_matrix.set(i, j, tree_list[i]->targets[j]->name);
     }
     
-    // THERE IS A LOCK HERE, do not comment it out by accident!
-    // jesus christ people.
-    //#pragma omp parallel for
-    for(int i = 0; i < 2 * (this->size); i++){
+    /* Build the pair for each node name in parallel. Each name writes to
+     * its own slot, and the slots are compacted afterwards in order, so the
+     * pairs come out in the same order whatever the number of threads.
+     */
+    int num_names = 2 * (this->size);
+    std::vector<RabinPair*> pair_slots(num_names, (RabinPair*)NULL);
+    #pragma omp parallel for schedule(dynamic)
+    for(int i = 0; i < num_names; i++){
         RabinPair* pair = new RabinPair(ret->size);
         for(int j = 0; j < ret->size; j++){
             if(tree_list[j]->marked_nodes[i])
@@ -610,12 +743,15 @@ DRW* NBW::determinize() const{
                 pair->finite.set(j);
         }
         if(pair->infinite.any()){
-            //#pragma omp critical (ret_pair_locks) // OMG LOCK.
-                ret->pairs.push_back(pair);
+            pair_slots[i] = pair;
         } else {
             delete pair;
         }
     }
+    for(int i = 0; i < num_names; i++){
+        if(pair_slots[i] != NULL)
+            ret->pairs.push_back(pair_slots[i]);
+    }
 
 
     SafraTree::trees = tree_list;
@@ -631,6 +767,452 @@ DRW* NBW::determinize() const{
     return ret;
 } // end DRW* NBW::determinize() const
 
+/** A state of NBW::determinize_by_components. */
+struct ComponentState{
+    state_set_t reachable;
+    state_set_t breakpoint; // runs which have stayed in the weak components since the last breakpoint
+    std::vector<std::vector<int> > runs; // per deterministic component: (state, name) pairs, oldest first
+    std::vector<SafraTree*> trees; // per Safra component
+};
+
+/* The key identifying @param q among the states of the Rabin automaton. */
+static void component_state_key(const ComponentState& q, std::vector<unsigned long>& key){
+    key.clear();
+    boost::to_block_range(q.reachable, std::back_inserter(key));
+    boost::to_block_range(q.breakpoint, std::back_inserter(key));
+    for(int d = 0; d < q.runs.size(); d++){
+        key.push_back(q.runs[d].size());
+        key.insert(key.end(), q.runs[d].begin(), q.runs[d].end());
+    }
+    for(int s = 0; s < q.trees.size(); s++)
+        key.push_back(q.trees[s]->name);
+}
+
+DRW* NBW::determinize_by_components() const{
+    if(this->size == 0)
+        return this->determinize();
+    
+    int n = this->size;
+    int k = this->alphabet_size;
+    SafraTree::reset();
+    
+    /* ----------- find and classify the components ----------- */
+    std::vector<int> scc;
+    std::vector<bool> on_cycle;
+    int num_sccs = this->components(scc, on_cycle);
+    std::vector<std::vector<int> > members(num_sccs);
+    std::vector<bool> has_final(num_sccs, false);
+    for(int s = 0; s < n; s++){
+        members[scc[s]].push_back(s);
+        if(this->final[s])
+            has_final[scc[s]] = true;
+    }
+    
+    /* A component is inherently weak if it has no cycle of non-final
+     * states, and deterministic if no state has two successors inside the
+     * component on the same character.
+     */
+    BoostGraph rejecting(n);
+    std::vector<bool> rejecting_loop(n, false);
+    std::vector<bool> deterministic(num_sccs, true);
+    for(int s = 0; s < n; s++){
+        for(int c = 0; c < k; c++){
+            const state_set_t& targets = this->transition_matrix[s * k + c];
+            int inside = 0;
+            for(int t = targets.find_first(); t >= 0 && t < n; t = targets.find_next(t)){
+                if(scc[t] != scc[s]) continue;
+                inside++;
+                if(!this->final[s] && !this->final[t]){
+                    boost::add_edge(s, t, rejecting);
+                    if(t == s)
+                        rejecting_loop[s] = true;
+                }
+            }
+            if(inside > 1)
+                deterministic[scc[s]] = false;
+        }
+    }
+    std::vector<int> rejecting_scc(n);
+    boost::strong_components(rejecting, &rejecting_scc[0]);
+    std::vector<int> rejecting_size(n, 0);
+    for(int s = 0; s < n; s++)
+        rejecting_size[rejecting_scc[s]]++;
+    std::vector<bool> rejecting_cycle(num_sccs, false);
+    for(int s = 0; s < n; s++)
+        if(!this->final[s] && (rejecting_size[rejecting_scc[s]] > 1 || rejecting_loop[s]))
+            rejecting_cycle[scc[s]] = true;
+    
+    state_set_t weak_states(n);
+    std::vector<std::vector<int> > det_components;
+    std::vector<std::vector<int> > safra_components;
+    for(int i = 0; i < num_sccs; i++){
+        if(!on_cycle[members[i][0]] || !has_final[i])
+            continue; // no run can accept by staying here
+        if(!rejecting_cycle[i]){
+            for(int j = 0; j < members[i].size(); j++)
+                weak_states.set(members[i][j]);
+        } else if(deterministic[i]){
+            det_components.push_back(members[i]);
+        } else {
+            safra_components.push_back(members[i]);
+        }
+    }
+    
+    // the number of each state inside its component
+    std::vector<int> local(n, -1);
+    for(int i = 0; i < num_sccs; i++)
+        for(int j = 0; j < members[i].size(); j++)
+            local[members[i][j]] = j;
+    
+    // the successor of each state of a deterministic component inside it, or -1
+    std::vector<std::vector<int> > det_successors(det_components.size());
+    for(int d = 0; d < det_components.size(); d++){
+        const std::vector<int>& component = det_components[d];
+        det_successors[d].resize(component.size() * k, -1);
+        for(int j = 0; j < component.size(); j++){
+            for(int c = 0; c < k; c++){
+                const state_set_t& targets = this->transition_matrix[component[j] * k + c];
+                for(int t = targets.find_first(); t >= 0 && t < n; t = targets.find_next(t))
+                    if(scc[t] == scc[component[j]])
+                        det_successors[d][j * k + c] = local[t];
+            }
+        }
+    }
+    
+    /* The automaton inside each Safra component, with one more state m
+     * standing for the runs outside the component which can still enter it:
+     * it is in the root whenever such runs exist, and since it is not final
+     * it keeps the root from being marked, as the states outside the
+     * component would in Safra's construction for the whole automaton.
+     */
+    std::vector<NBW*> parts;
+    std::vector<state_set_t> feeders; // the states outside each component with a path into it
+    std::vector<std::vector<int> > predecessors(n);
+    for(int s = 0; s < n; s++)
+        for(int c = 0; c < k; c++){
+            const state_set_t& targets = this->transition_matrix[s * k + c];
+            for(int t = targets.find_first(); t >= 0 && t < n; t = targets.find_next(t))
+                predecessors[t].push_back(s);
+        }
+    for(int p = 0; p < safra_components.size(); p++){
+        const std::vector<int>& component = safra_components[p];
+        int m = component.size();
+        
+        state_set_t feeds(n);
+        std::vector<int> search_queue(component);
+        for(int i = 0; i < search_queue.size(); i++){
+            for(int j = 0; j < predecessors[search_queue[i]].size(); j++){
+                int s = predecessors[search_queue[i]][j];
+                if(!feeds[s] && scc[s] != scc[component[0]]){
+                    feeds.set(s);
+                    search_queue.push_back(s);
+                }
+            }
+        }
+        feeders.push_back(feeds);
+        
+        std::vector<boost::tuple<int, int, int> > adjacency_list;
+        state_set_t part_initial(m + 1);
+        state_set_t part_final(m + 1);
+        if(this->initial.intersects(feeds))
+            part_initial.set(m);
+        for(int j = 0; j < m; j++){
+            if(this->initial[component[j]]) part_initial.set(j);
+            if(this->final[component[j]]) part_final.set(j);
+            for(int c = 0; c < k; c++){
+                const state_set_t& targets = this->transition_matrix[component[j] * k + c];
+                for(int t = targets.find_first(); t >= 0 && t < n; t = targets.find_next(t))
+                    if(scc[t] == scc[component[j]])
+                        adjacency_list.push_back(boost::make_tuple(j, c, local[t]));
+            }
+        }
+        parts.push_back(new NBW(m + 1, k, adjacency_list, part_initial, part_final));
+        parts.back()->find_safra_hints();
+    }
+    
+    /* ----------- explore the product of the trackers ----------- */
+    std::vector<ComponentState*> states;
+    std::vector<int> transitions;
+    boost::unordered_map<std::vector<unsigned long>, int> index;
+    std::vector<stree_set_t> trees(parts.size());
+    std::vector<int> num_trees(parts.size(), 0);
+    std::vector<unsigned long> key;
+    
+    ComponentState* q = new ComponentState();
+    q->reachable = this->initial;
+    q->breakpoint.resize(n);
+    q->runs.resize(det_components.size());
+    for(int d = 0; d < det_components.size(); d++)
+        for(int j = 0, name = 0; j < det_components[d].size(); j++)
+            if(this->initial[det_components[d][j]]){
+                q->runs[d].push_back(j);
+                q->runs[d].push_back(name++);
+            }
+    for(int p = 0; p < parts.size(); p++){
+        SafraTree* tree = SafraTree::build_initial_tree(*parts[p]);
+        tree->name = num_trees[p]++;
+        trees[p].insert(tree);
+        q->trees.push_back(tree);
+    }
+    component_state_key(*q, key);
+    index[key] = 0;
+    states.push_back(q);
+    
+    for(int i = 0; i < states.size(); i++){
+        for(int c = 0; c < k; c++){
+            const ComponentState& from = *states[i];
+            q = new ComponentState();
+            q->reachable = from.reachable;
+            this->transition(q->reachable, c+1);
+            
+            // breakpoint: follow the runs which have not left the weak components
+            q->breakpoint = (from.breakpoint.none() ? from.reachable : from.breakpoint);
+            this->transition(q->breakpoint, c+1);
+            q->breakpoint &= weak_states;
+            
+            /* Deterministic components: move each run, dropping those which
+             * leave the component or merge into an older run, then add the
+             * runs which just entered. A name freed on this step is not given
+             * out again until the next one, so that the pair of the name sees
+             * it unused.
+             */
+            q->runs.resize(det_components.size());
+            for(int d = 0; d < det_components.size(); d++){
+                const std::vector<int>& component = det_components[d];
+                const std::vector<int>& old_runs = from.runs[d];
+                int m = component.size();
+                std::vector<bool> claimed(m, false);
+                std::vector<bool> unavailable(2 * m, false);
+                for(int r = 0; r < old_runs.size(); r += 2){
+                    int t = det_successors[d][old_runs[r] * k + c];
+                    unavailable[old_runs[r+1]] = true;
+                    if(t < 0 || claimed[t])
+                        continue;
+                    claimed[t] = true;
+                    q->runs[d].push_back(t);
+                    q->runs[d].push_back(old_runs[r+1]);
+                }
+                for(int j = 0, name = 0; j < m; j++){
+                    if(claimed[j] || !q->reachable[component[j]])
+                        continue;
+                    while(unavailable[name])
+                        name++;
+                    unavailable[name] = true;
+                    q->runs[d].push_back(j);
+                    q->runs[d].push_back(name);
+                }
+            }
+            
+            // Safra components: the root also gets the states just entered
+            for(int p = 0; p < parts.size(); p++){
+                const std::vector<int>& component = safra_components[p];
+                state_set_t entering(component.size() + 1);
+                for(int j = 0; j < component.size(); j++)
+                    if(q->reachable[component[j]])
+                        entering.set(j);
+                if(q->reachable.intersects(feeders[p]))
+                    entering.set(component.size());
+                SafraTree* tree = SafraTree::get_transition(*from.trees[p], *parts[p], c+1, &entering);
+                stree_set_t::iterator loc = trees[p].find(tree);
+                if(loc == trees[p].end()){
+                    tree->name = num_trees[p]++;
+                    trees[p].insert(tree);
+                } else {
+                    SafraTree::release(tree);
+                    tree = *loc;
+                }
+                q->trees.push_back(tree);
+            }
+            
+            component_state_key(*q, key);
+            boost::unordered_map<std::vector<unsigned long>, int>::iterator loc = index.find(key);
+            if(loc == index.end()){
+                transitions.push_back(states.size());
+                index[key] = states.size();
+                states.push_back(q);
+            } else {
+                transitions.push_back(loc->second);
+                delete q;
+            }
+        }
+    }
+    
+    /* ----------- build the Rabin automaton ----------- */
+    DRW* ret = new DRW();
+    ret->alphabet = this->alphabet;
+    ret->char_labels = this->char_labels;
+    ret->alphabet_size = k;
+    ret->initial_state = 0;
+    ret->size = states.size();
+    ret->transition_matrix.resize(ret->size, k);
+    for(int i = 0; i < ret->size; i++)
+        for(int c = 0; c < k; c++)
+            ret->transition_matrix.set(i, c, transitions[i * k + c]);
+    
+    // weak components: accept if the breakpoint set is empty finitely often
+    if(weak_states.any()){
+        RabinPair* pair = new RabinPair(ret->size);
+        pair->infinite.set();
+        for(int i = 0; i < ret->size; i++)
+            if(states[i]->breakpoint.none())
+                pair->finite.set(i);
+        ret->pairs.push_back(pair);
+    }
+    
+    // deterministic components: a name is used from some point on, and its run visits final states
+    for(int d = 0; d < det_components.size(); d++){
+        int m = det_components[d].size();
+        for(int name = 0; name < 2 * m; name++){
+            RabinPair* pair = new RabinPair(ret->size);
+            for(int i = 0; i < ret->size; i++){
+                const std::vector<int>& runs = states[i]->runs[d];
+                bool used = false;
+                for(int r = 0; r < runs.size() && !used; r += 2){
+                    if(runs[r+1] != name) continue;
+                    used = true;
+                    if(this->final[det_components[d][runs[r]]])
+                        pair->infinite.set(i);
+                }
+                if(!used)
+                    pair->finite.set(i);
+            }
+            if(pair->infinite.any())
+                ret->pairs.push_back(pair);
+            else
+                delete pair;
+        }
+    }
+    
+    // Safra components: as in determinize, one pair per node name
+    for(int p = 0; p < parts.size(); p++){
+        for(int name = 0; name < 2 * parts[p]->size; name++){
+            RabinPair* pair = new RabinPair(ret->size);
+            for(int i = 0; i < ret->size; i++){
+                const SafraTree* tree = states[i]->trees[p];
+                if(tree->marked_nodes[name])
+                    pair->infinite.set(i);
+                else if(tree->used_node_names[name] == false)
+                    pair->finite.set(i);
+            }
+            if(pair->infinite.any())
+                ret->pairs.push_back(pair);
+            else
+                delete pair;
+        }
+    }
+    
+    if(verbose_output)
+        printf("Determinized by components (%d weak states, %d deterministic and %d Safra components): %d states -> %d states\n",
+               (int)weak_states.count(), (int)det_components.size(), (int)parts.size(), n, ret->size);
+    
+    for(int i = 0; i < states.size(); i++)
+        delete states[i];
+    for(int p = 0; p < parts.size(); p++)
+        delete parts[p];
+    SafraTree::reset(); // the trees do not correspond to the states of the result
+    return ret;
+} // end DRW* NBW::determinize_by_components() const
+
+void NBW::clear_safra_hints(){
+    this->simulators.clear();
+    this->accepting_sinks.clear();
+    this->always_marked.clear();
+} // end void NBW::clear_safra_hints()
+
+DRW* NBW::determinize_with_hints(){
+    if(DECOMPOSE_DETERMINIZATION)
+        return this->determinize_by_components(); // finds the hints of each component
+    this->find_safra_hints();
+    DRW* ret = this->determinize();
+    this->clear_safra_hints();
+    return ret;
+} // end DRW* NBW::determinize_with_hints()
+
+void NBW::find_safra_hints(){
+    int n = this->size;
+    int k = this->alphabet_size;
+    this->clear_safra_hints();
+    
+    if(SAFRA_ACCEPTING_SINKS){
+        this->accepting_sinks.resize(n);
+        for(int q = 0; q < n; q++){
+            bool sink = this->final[q];
+            for(int c = 0; c < k && sink; c++)
+                sink = this->transition_matrix[q * k + c][q];
+            if(sink)
+                this->accepting_sinks.set(q);
+        }
+    }
+    
+    /* Direct simulation, as a greatest fixed point: q' simulates q if q' is
+     * final whenever q is, and each move of q is matched by a move of q' on
+     * the same character to a state which simulates the target.
+     */
+    if(SAFRA_SIMULATION && n <= SAFRA_SIMULATION_MAX_STATES){
+        state_set_t all(n);
+        all.set();
+        std::vector<state_set_t> up(n); // the states which simulate q, q included
+        for(int q = 0; q < n; q++)
+            up[q] = (this->final[q] ? this->final : all);
+        bool changed = true;
+        while(changed){
+            changed = false;
+            for(int q = 0; q < n; q++){
+                for(int r = up[q].find_first(); r >= 0 && r < n; r = up[q].find_next(r)){
+                    if(r == q) continue;
+                    bool simulates = true;
+                    for(int c = 0; c < k && simulates; c++){
+                        const state_set_t& moves = this->transition_matrix[q * k + c];
+                        const state_set_t& answers = this->transition_matrix[r * k + c];
+                        for(int p = moves.find_first(); p >= 0 && p < n && simulates; p = moves.find_next(p))
+                            simulates = answers.intersects(up[p]);
+                    }
+                    if(!simulates){
+                        up[q].reset(r);
+                        changed = true;
+                    }
+                }
+            }
+        }
+        for(int q = 0; q < n; q++)
+            up[q].reset(q);
+        this->simulators.swap(up);
+    }
+    
+    if(SAFRA_ALWAYS_MARKED){
+        std::vector<int> sccs;
+        std::vector<bool> on_cycle;
+        int num_sccs = this->components(sccs, on_cycle);
+        std::vector<bool> qualifies(num_sccs, true);
+        for(int q = 0; q < n; q++){
+            if(!on_cycle[q] || !this->final[q])
+                qualifies[sccs[q]] = false;
+            for(int c = 0; c < k; c++){
+                const state_set_t& targets = this->transition_matrix[q * k + c];
+                int inside = 0;
+                for(int t = targets.find_first(); t >= 0 && t < n; t = targets.find_next(t))
+                    if(sccs[t] == sccs[q])
+                        inside++;
+                if(inside > 1)
+                    qualifies[sccs[q]] = false;
+            }
+        }
+        this->always_marked.resize(n);
+        for(int q = 0; q < n; q++)
+            if(qualifies[sccs[q]])
+                this->always_marked.set(q);
+    }
+    
+    if(verbose_output){
+        int simulated = 0;
+        for(int q = 0; q < this->simulators.size(); q++)
+            if(this->simulators[q].any())
+                simulated++;
+        printf("Safra hints: %d simulated states, %d accepting sinks, %d always marked states\n",
+               simulated, (int)this->accepting_sinks.count(), (int)this->always_marked.count());
+    }
+} // end void NBW::find_safra_hints()
+
 
 NBW* NBW::build_random_automaton( int states, int alphabet_size, double transition_density, double final_state_density ){
     NBW* ret = new NBW();
@@ -717,12 +1299,272 @@ NBW* NBW::build_random_automaton( int states, int alphabet_size, double transiti
 
 NBW* NBW::get_complement() {
     this->trim();
-    DRW* det = this->determinize();
-    NBW* ret = det->complement();
-    delete det;
+    NBW* ret;
+    AcceptanceType type = (WEAK_COMPLEMENT ? this->classify() : GENERAL_AUTOMATON);
+    if(this->is_deterministic()){
+        ret = this->deterministic_complement();
+    } else if(type == TERMINAL_AUTOMATON){
+        ret = this->powerset_complement();
+    } else if(type == WEAK_AUTOMATON){
+        ret = this->breakpoint_complement();
+    } else if(LAZY_COMPLEMENT){
+        this->find_safra_hints();
+        ret = DRW::lazy_complement(*this);
+        this->clear_safra_hints();
+    } else {
+        DRW* det = this->determinize_with_hints();
+        det->reduce_pairs();
+        det->minimize(true);
+        ret = det->complement();
+        delete det;
+    }
+    if(verbose_output && type != GENERAL_AUTOMATON && !this->is_deterministic())
+        printf("Complement of a %s automaton: %d states -> %d states (%s construction)\n",
+               (type == TERMINAL_AUTOMATON ? "terminal" : "weak"), this->size, ret->size,
+               (type == TERMINAL_AUTOMATON ? "subset" : "breakpoint"));
+    ret->track_vars = this->track_vars;
     return ret;
 } // end NBW* NBW::complement() const
 
+bool NBW::is_deterministic() const{
+    if(this->initial.count() != 1)
+        return false;
+    for(int i = 0; i < (this->size)*(this->alphabet_size); i++)
+        if(this->transition_matrix[i].count() > 1)
+            return false;
+    return true;
+} // end bool NBW::is_deterministic() const
+
+NBW* NBW::deterministic_complement() const{
+    int sink = this->size;
+    
+    // the states of the second copy: those which are not final, and the sink
+    std::vector<int> second(this->size + 1, -1);
+    int size = this->size + 1;
+    for(int s = 0; s <= sink; s++)
+        if(s == sink || !this->final[s])
+            second[s] = size++;
+    
+    std::vector<boost::tuple<int, int, int> > adjacency_list;
+    for(int s = 0; s <= sink; s++){
+        for(int c = 0; c < this->alphabet_size; c++){
+            int t = sink;
+            if(s != sink){
+                int target = this->transition_matrix[s * this->alphabet_size + c].find_first();
+                if(target >= 0 && target < this->size)
+                    t = target;
+            }
+            adjacency_list.push_back(boost::make_tuple(s, c, t));
+            if(second[t] >= 0){
+                adjacency_list.push_back(boost::make_tuple(s, c, second[t]));
+                if(second[s] >= 0)
+                    adjacency_list.push_back(boost::make_tuple(second[s], c, second[t]));
+            }
+        }
+    }
+    
+    state_set_t new_initial(size);
+    state_set_t new_final(size);
+    int initial_state = this->initial.find_first();
+    new_initial.set(initial_state);
+    if(second[initial_state] >= 0)
+        new_initial.set(second[initial_state]);
+    for(int s = 0; s <= sink; s++)
+        if(second[s] >= 0)
+            new_final.set(second[s]);
+    
+    std::vector<std::string> new_state_labels;
+    if(this->state_labels.size() >= this->size){
+        for(int s = 0; s <= sink; s++)
+            new_state_labels.push_back("1-" + (s == sink ? std::string("SINK") : this->state_labels[s]));
+        for(int s = 0; s <= sink; s++)
+            if(second[s] >= 0)
+                new_state_labels.push_back("2-" + (s == sink ? std::string("SINK") : this->state_labels[s]));
+    }
+    
+    NBW* ret = build_trimmed(size, this->alphabet_size, adjacency_list, new_initial, new_final,
+                             this->char_labels, new_state_labels);
+    if(verbose_output)
+        printf("Deterministic complement: %d states -> %d states\n", this->size, ret->size);
+    return ret;
+} // end NBW* NBW::deterministic_complement() const
+
+int NBW::components(std::vector<int>& sccs, std::vector<bool>& on_cycle) const{
+    BoostGraph g(this->size);
+    std::vector<bool> self_loop(this->size, false);
+    for(int s = 0; s < this->size; s++){
+        for(int c = 0; c < this->alphabet_size; c++){
+            const state_set_t& targets = this->transition_matrix[s * this->alphabet_size + c];
+            for(int t = targets.find_first(); t >= 0 && t < this->size; t = targets.find_next(t)){
+                boost::add_edge(s, t, g);
+                if(t == s)
+                    self_loop[s] = true;
+            }
+        }
+    }
+    
+    sccs.resize(this->size);
+    int num_sccs = (this->size > 0 ? boost::strong_components(g, &sccs[0]) : 0);
+    std::vector<int> component_size(num_sccs, 0);
+    for(int s = 0; s < this->size; s++)
+        component_size[sccs[s]]++;
+    on_cycle.resize(this->size);
+    for(int s = 0; s < this->size; s++)
+        on_cycle[s] = (component_size[sccs[s]] > 1 || self_loop[s]);
+    return num_sccs;
+} // end int NBW::components(std::vector<int>& sccs, std::vector<bool>& on_cycle) const
+
+AcceptanceType NBW::classify() const{
+    std::vector<int> sccs;
+    std::vector<bool> on_cycle;
+    int num_sccs = this->components(sccs, on_cycle);
+    std::vector<bool> component_final(num_sccs, false);
+    std::vector<bool> component_nonfinal(num_sccs, false);
+    for(int s = 0; s < this->size; s++){
+        if(this->final[s])
+            component_final[sccs[s]] = true;
+        else
+            component_nonfinal[sccs[s]] = true;
+    }
+    
+    for(int s = 0; s < this->size; s++){
+        int c = sccs[s];
+        if(on_cycle[s] && component_final[c] && component_nonfinal[c])
+            return GENERAL_AUTOMATON;
+    }
+    
+    if(!this->final_states_closed())
+        return WEAK_AUTOMATON;
+    for(int s = 0; s < this->size; s++){
+        if(!this->final[s]) continue;
+        for(int c = 0; c < this->alphabet_size; c++)
+            if(this->transition_matrix[s * this->alphabet_size + c].none())
+                return WEAK_AUTOMATON;
+    }
+    return TERMINAL_AUTOMATON;
+} // end AcceptanceType NBW::classify() const
+
+NBW* NBW::powerset_complement() const{
+    std::vector<boost::tuple<int, int, int> > adjacency_list;
+    
+    // a run which reaches a final state is accepting, whatever follows
+    if(this->initial.intersects(this->final)){
+        state_set_t new_initial(1);
+        new_initial.set(0);
+        return new NBW(1, this->alphabet_size, adjacency_list, new_initial, state_set_t(1), this->char_labels);
+    }
+    
+    boost::unordered_map<std::vector<bool>, int> index;
+    std::vector<state_set_t> subsets;
+    std::vector<bool> key(this->size);
+    for(int s = 0; s < this->size; s++)
+        key[s] = this->initial[s];
+    index[key] = 0;
+    subsets.push_back(this->initial);
+    
+    for(int i = 0; i < subsets.size(); i++){
+        for(int c = 0; c < this->alphabet_size; c++){
+            state_set_t targets(this->size);
+            for(int s = subsets[i].find_first(); s >= 0 && s < this->size; s = subsets[i].find_next(s))
+                targets |= this->transition_matrix[s * this->alphabet_size + c];
+            if(targets.intersects(this->final))
+                continue;
+            for(int s = 0; s < this->size; s++)
+                key[s] = targets[s];
+            boost::unordered_map<std::vector<bool>, int>::iterator loc = index.find(key);
+            int target;
+            if(loc == index.end()){
+                target = subsets.size();
+                index[key] = target;
+                subsets.push_back(targets);
+            } else {
+                target = loc->second;
+            }
+            adjacency_list.push_back(boost::make_tuple(i, c, target));
+        }
+    }
+    
+    int size = subsets.size();
+    state_set_t new_initial(size);
+    new_initial.set(0);
+    state_set_t new_final(size);
+    new_final.set();
+    return build_trimmed(size, this->alphabet_size, adjacency_list, new_initial, new_final, this->char_labels);
+} // end NBW* NBW::powerset_complement() const
+
+NBW* NBW::breakpoint_complement() const{
+    std::vector<boost::tuple<int, int, int> > adjacency_list;
+    boost::unordered_map<std::vector<bool>, int> index;
+    std::vector<std::pair<state_set_t, state_set_t> > states; // (S, O)
+    
+    // start at a breakpoint: O is empty
+    std::vector<bool> key(2 * this->size);
+    for(int s = 0; s < this->size; s++)
+        key[s] = this->initial[s];
+    index[key] = 0;
+    states.push_back(std::make_pair(this->initial, state_set_t(this->size)));
+    
+    for(int i = 0; i < states.size(); i++){
+        for(int c = 0; c < this->alphabet_size; c++){
+            const state_set_t& from = states[i].first;
+            const state_set_t& owing = states[i].second;
+            state_set_t reached(this->size);
+            for(int s = from.find_first(); s >= 0 && s < this->size; s = from.find_next(s))
+                reached |= this->transition_matrix[s * this->alphabet_size + c];
+            
+            // runs leave O when they visit a non-final state
+            state_set_t still_owing(this->size);
+            if(owing.none()){
+                still_owing = reached;
+            } else {
+                for(int s = owing.find_first(); s >= 0 && s < this->size; s = owing.find_next(s))
+                    still_owing |= this->transition_matrix[s * this->alphabet_size + c];
+            }
+            still_owing &= this->final;
+            
+            for(int s = 0; s < this->size; s++){
+                key[s] = reached[s];
+                key[this->size + s] = still_owing[s];
+            }
+            boost::unordered_map<std::vector<bool>, int>::iterator loc = index.find(key);
+            int target;
+            if(loc == index.end()){
+                target = states.size();
+                index[key] = target;
+                states.push_back(std::make_pair(reached, still_owing));
+            } else {
+                target = loc->second;
+            }
+            adjacency_list.push_back(boost::make_tuple(i, c, target));
+        }
+    }
+    
+    int size = states.size();
+    state_set_t new_initial(size);
+    new_initial.set(0);
+    state_set_t new_final(size);
+    for(int i = 0; i < size; i++)
+        if(states[i].second.none())
+            new_final.set(i);
+    return build_trimmed(size, this->alphabet_size, adjacency_list, new_initial, new_final, this->char_labels);
+} // end NBW* NBW::breakpoint_complement() const
+
+bool NBW::is_universal() {
+    this->trim();
+    if(this->size == 0)
+        return false; // trimmed to nothing: the language is empty
+    if(this->is_deterministic() || (WEAK_COMPLEMENT && this->classify() != GENERAL_AUTOMATON)){
+        NBW* complement = this->get_complement();
+        bool ret = complement->is_empty();
+        delete complement;
+        return ret;
+    }
+    DRW* det = this->determinize_with_hints();
+    bool ret = det->is_universal();
+    delete det;
+    return ret;
+} // end bool NBW::is_universal()
+
 /**
  * Create the NBW automaton accepting L(one) \union L(two). 
  * It has |one| + |two| states.
@@ -740,6 +1582,7 @@ NBW* NBW::disjoint_sum(NBW* one, NBW* two){
     ret->alphabet_size = one->alphabet_size;
     
     ret->char_labels = std::vector<std::string>(one->char_labels);
+    ret->track_vars = one->track_vars;
     
     // preserve pretty state labels if both input automata had them
     if(one->state_labels.size() >= one->size 
@@ -853,6 +1696,7 @@ NBW* NBW::product(NBW* one, NBW* two){
     ret->alphabet_size = one->alphabet_size;
     
     ret->char_labels = std::vector<std::string>(one->char_labels);
+    ret->track_vars = one->track_vars;
     
     // preserve pretty state labels if both input automata had them
     if(one->state_labels.size() >= one->size 
@@ -931,6 +1775,106 @@ NBW* NBW::product(NBW* one, NBW* two){
     return ret;    
 } // end NBW* NBW::product(NBW* one, NBW* two)
 
+bool NBW::final_states_closed() const{
+    for(int s = 0; s < this->size; s++){
+        if(!this->final[s]) continue;
+        for(int c = 0; c < this->alphabet_size; c++)
+            if(!this->transition_matrix[s*alphabet_size + c].is_subset_of(this->final))
+                return false;
+    }
+    return true;
+} // end bool NBW::final_states_closed() const
+
+/**
+ * Create the NBW automaton accepting L(one) \intersect L(two). Only the
+ * pairs of states which are reachable from a pair of initial states are
+ * built, and the result is trimmed.
+ * *Requires that one and two have the same alphabet.*
+ */
+NBW* NBW::intersection(NBW* one, NBW* two){
+    one->trim();
+    two->trim();
+    
+    /* When no transition leaves the final states of either automaton (as in
+     * the automata built for formulas, where a state is final once every
+     * negative literal has been satisfied), a run is accepted if it ends up
+     * in final states of both, and a pair is final if both states are.
+     * Otherwise a flag is added: with flag 0 the run waits for a final state
+     * of one, with flag 1 for a final state of two.
+     */
+    int flags = (one->final_states_closed() && two->final_states_closed()) ? 1 : 2;
+    
+    boost::unordered_map<long, int> index; // (s1, s2, flag) -> state
+    std::vector<long> states;
+    std::vector<int> initial_states;
+    for(int s1 = 0; s1 < one->size; s1++){
+        if(!one->initial[s1]) continue;
+        for(int s2 = 0; s2 < two->size; s2++){
+            if(!two->initial[s2]) continue;
+            long key = ((long)s1 * two->size + s2) * flags;
+            index[key] = states.size();
+            initial_states.push_back(states.size());
+            states.push_back(key);
+        }
+    }
+    
+    std::vector<boost::tuple<int, int, int> > adjacency_list;
+    for(int i = 0; i < states.size(); i++){
+        int flag = states[i] % flags;
+        int s1 = (states[i] / flags) / two->size;
+        int s2 = (states[i] / flags) % two->size;
+        int next_flag = flag;
+        if(flags == 2 && flag == 0 && one->final[s1])
+            next_flag = 1;
+        else if(flags == 2 && flag == 1 && two->final[s2])
+            next_flag = 0;
+        
+        for(int c = 0; c < one->alphabet_size; c++){
+            const state_set_t& t1 = one->transition_matrix[s1*(one->alphabet_size) + c];
+            const state_set_t& t2 = two->transition_matrix[s2*(two->alphabet_size) + c];
+            if(t1.none() || t2.none()) continue;
+            for(int u1 = t1.find_first(); u1 >= 0 && u1 < one->size; u1 = t1.find_next(u1)){
+                for(int u2 = t2.find_first(); u2 >= 0 && u2 < two->size; u2 = t2.find_next(u2)){
+                    long key = ((long)u1 * two->size + u2) * flags + next_flag;
+                    boost::unordered_map<long, int>::iterator loc = index.find(key);
+                    int target;
+                    if(loc == index.end()){
+                        target = states.size();
+                        index[key] = target;
+                        states.push_back(key);
+                    } else {
+                        target = loc->second;
+                    }
+                    adjacency_list.push_back(boost::make_tuple(i, c, target));
+                }
+            }
+        }
+    }
+    
+    int size = states.size() > 0 ? states.size() : 1;
+    state_set_t initial(size);
+    for(int i = 0; i < initial_states.size(); i++)
+        initial.set(initial_states[i]);
+    state_set_t final(size);
+    std::vector<std::string> state_labels;
+    bool labeled = (one->state_labels.size() >= one->size 
+                    && two->state_labels.size() >= two->size);
+    for(int i = 0; i < states.size(); i++){
+        int flag = states[i] % flags;
+        int s1 = (states[i] / flags) / two->size;
+        int s2 = (states[i] / flags) % two->size;
+        if(flags == 1 ? (one->final[s1] && two->final[s2]) : (flag == 1 && two->final[s2]))
+            final.set(i);
+        if(labeled)
+            state_labels.push_back(one->state_labels[s1] + " & " + two->state_labels[s2]);
+    }
+    
+    NBW* ret = build_trimmed(size, one->alphabet_size, adjacency_list, initial, final, 
+                             one->char_labels, state_labels);
+    ret->track_vars = one->track_vars;
+    return ret;
+} // end NBW* NBW::intersection(NBW* one, NBW* two)
+
 
 /** Returns true IFF the language of the automaton is empty. 
  */
@@ -945,14 +1889,25 @@ bool NBW::is_empty(){
 
 
 void NBW::project(int track_index){
+    this->project_tracks(1 << track_index);
+} // end void NBW::project(int track_index)
+
+void NBW::project_tracks(int track_mask){
     this->trimmed = false;
+    /* The characters which differ only on the projected tracks are merged
+     * into a group; each state goes to the union of its targets over the
+     * group on every character of the group. A group is named by its
+     * character with all projected tracks clear.
+     */
     for(int c1 = 0; c1 < this->alphabet_size; c1++){
-        int c2 = c1 ^ (1 << track_index); // toggle the bit corresponding to that track
-        if(c2 > c1){
-            for(int s = 0; s < this->size; s++){
-                transition_matrix[s*alphabet_size + c1] |= transition_matrix[s*alphabet_size + c2];
-                transition_matrix[s*alphabet_size + c2] |= transition_matrix[s*alphabet_size + c1];
-            }
+        if(c1 & track_mask)
+            continue;
+        for(int s = 0; s < this->size; s++){
+            state_set_t& merged = transition_matrix[s*alphabet_size + c1];
+            for(int sub = track_mask; sub != 0; sub = (sub - 1) & track_mask)
+                merged |= transition_matrix[s*alphabet_size + (c1 | sub)];
+            for(int sub = track_mask; sub != 0; sub = (sub - 1) & track_mask)
+                transition_matrix[s*alphabet_size + (c1 | sub)] = merged;
         }
     }
     
@@ -971,7 +1926,116 @@ void NBW::project(int track_index){
         }
         
     }
-} // end void NBW::project(int track_index)
+} // end void NBW::project_tracks(int track_mask)
+
+void NBW::project_variable(int var){
+    if(this->track_vars.empty()){
+        if((1 << var) < this->alphabet_size)
+            this->project(var);
+        return;
+    }
+    for(int t = 0; t < this->track_vars.size(); t++){
+        if(this->track_vars[t] == var){
+            this->project(t);
+            return;
+        }
+    }
+} // end void NBW::project_variable(int var)
+
+void NBW::project_variables(const std::vector<int>& vars){
+    int track_mask = 0;
+    for(int i = 0; i < vars.size(); i++){
+        if(this->track_vars.empty()){
+            if((1 << vars[i]) < this->alphabet_size)
+                track_mask |= (1 << vars[i]);
+            continue;
+        }
+        for(int t = 0; t < this->track_vars.size(); t++)
+            if(this->track_vars[t] == vars[i])
+                track_mask |= (1 << t);
+    }
+    if(track_mask != 0)
+        this->project_tracks(track_mask);
+} // end void NBW::project_variables(const std::vector<int>& vars)
+
+NBW* NBW::expand_tracks(const std::vector<int>& vars) const{
+    // where each old track lands among the new tracks
+    std::vector<int> new_track;
+    int old_tracks = this->track_vars.size();
+    for(int t = 0; t < old_tracks; t++){
+        int position = std::find(vars.begin(), vars.end(), this->track_vars[t]) - vars.begin();
+        assert(position < vars.size());
+        new_track.push_back(position);
+    }
+    
+    int new_alphabet_size = 1 << vars.size();
+    std::vector<boost::tuple<int, int, int> > adjacency_list;
+    std::vector<std::string> new_char_labels;
+    for(int c = 0; c < new_alphabet_size; c++){
+        int old_c = 0;
+        for(int t = 0; t < old_tracks; t++)
+            if(c & (1 << new_track[t]))
+                old_c |= (1 << t);
+        for(int s = 0; s < this->size; s++){
+            const state_set_t& targets = this->transition_matrix[s * this->alphabet_size + old_c];
+            for(int target = targets.find_first(); target >= 0 && target < this->size; target = targets.find_next(target))
+                adjacency_list.push_back(boost::make_tuple(s, c, target));
+        }
+        std::string label;
+        boost::to_string(slice(vars.size(), c), label);
+        new_char_labels.push_back(label);
+    }
+    
+    NBW* ret = new NBW(this->size, new_alphabet_size, adjacency_list, 
+                       this->initial, this->final, new_char_labels, this->state_labels);
+    ret->track_vars = vars;
+    return ret;
+} // end NBW* NBW::expand_tracks(const std::vector<int>& vars) const
+
+NBW* NBW::project_out(const std::vector<int>& vars) const{
+    int old_tracks = 0;
+    while((1 << old_tracks) < this->alphabet_size)
+        old_tracks++;
+    
+    // the tracks which are kept, in order, and the mask of the others
+    std::vector<int> kept_tracks;
+    std::vector<int> kept_vars;
+    int dropped_mask = 0;
+    for(int t = 0; t < old_tracks; t++){
+        int var = this->track_vars.empty() ? t : this->track_vars[t];
+        if(std::find(vars.begin(), vars.end(), var) == vars.end()){
+            kept_tracks.push_back(t);
+            kept_vars.push_back(var);
+        } else {
+            dropped_mask |= (1 << t);
+        }
+    }
+    
+    int new_alphabet_size = 1 << kept_tracks.size();
+    std::vector<boost::tuple<int, int, int> > adjacency_list;
+    std::vector<std::string> new_char_labels;
+    for(int c = 0; c < new_alphabet_size; c++){
+        int old_c = 0;
+        for(int t = 0; t < kept_tracks.size(); t++)
+            if(c & (1 << t))
+                old_c |= (1 << kept_tracks[t]);
+        for(int s = 0; s < this->size; s++){
+            state_set_t targets = this->transition_matrix[s * this->alphabet_size + old_c];
+            for(int sub = dropped_mask; sub != 0; sub = (sub - 1) & dropped_mask)
+                targets |= this->transition_matrix[s * this->alphabet_size + (old_c | sub)];
+            for(int target = targets.find_first(); target >= 0 && target < this->size; target = targets.find_next(target))
+                adjacency_list.push_back(boost::make_tuple(s, c, target));
+        }
+        std::string label;
+        boost::to_string(slice(kept_tracks.size(), c), label);
+        new_char_labels.push_back(label);
+    }
+    
+    NBW* ret = new NBW(this->size, new_alphabet_size, adjacency_list, 
+                       this->initial, this->final, new_char_labels, this->state_labels);
+    ret->track_vars = kept_vars;
+    return ret;
+} // end NBW* NBW::project_out(const std::vector<int>& vars) const
 
 state_set_t NBW::accessible_states() const{
     state_set_t accessible(this->initial);
@@ -18,6 +18,15 @@
 #include "SafraTree.hpp"
 #include "logic.hpp"
 
+/** The acceptance structure of an automaton, by its strongly connected
+ * components. An automaton is weak if no cycle has both final and non-final
+ * states, so that each run eventually stays in states which are all final
+ * or all non-final. It is terminal if in addition every transition from a
+ * final state goes to a final state, and every final state has a transition
+ * on every character, so that a run is accepting once it reaches one.
+ */
+enum AcceptanceType { TERMINAL_AUTOMATON, WEAK_AUTOMATON, GENERAL_AUTOMATON };
+
 class NBW{
     private:
         /********************************* pointer fields *********************************/        
@@ -54,7 +63,38 @@ class NBW{
         
     // Private helper functions
     static NBW* build_helper(const Conjunction& f, Boundary conditions);
-    static NBW* build_conjunction_automaton(const Conjunction& f, Boundary conditions);
+    static NBW* build_conjunction_automaton(const Conjunction& f, Boundary conditions, 
+                                            bool* needs_negated = NULL, int outer = 0);
+    static NBW* build_formula(const std::vector<Conjunction*>& formula, Boundary conditions, 
+                              bool* needs_negated = NULL);
+    static NBW* apply_quantifier_blocks(NBW* ret, const std::vector<QuantifierBlock>& blocks, 
+                                        int first_block, int last_block);
+    static NBW* apply_negation(NBW* ret, bool negate_result, bool* needs_negated);
+    
+    /* Project every track whose bit is set in @param track_mask. */
+    void project_tracks(int track_mask);
+    
+    /* Build the automaton for the literals of @param f with the variables
+     * @param early_vars projected, one small automaton per literal at a
+     * time (see PARTITION_CONJUNCTIONS in utils.hpp). Only for OMEGA.
+     */
+    static NBW* build_partitioned(const Conjunction& f, const std::vector<int>& early_vars);
+    
+    /* True if every transition from a final state goes to a final state. */
+    bool final_states_closed() const;
+    
+    /* Number the strongly connected components: @param sccs gets the
+     * component of each state, and @param on_cycle whether the state is on
+     * a cycle (its component has another state, or it has a loop). Returns
+     * the number of components.
+     */
+    int components(std::vector<int>& sccs, std::vector<bool>& on_cycle) const;
+    
+    /* Determinize for get_complement and is_universal, with the Safra
+     * hints of this automaton (or of its components) in place.
+     */
+    DRW* determinize_with_hints();
+    void clear_safra_hints();
 
     public:    
       /********************************* int fields *********************************/
@@ -90,6 +130,24 @@ class NBW{
          * currently just used for debugging purposes. May later signify alphabet structure.
          */
         std::vector<std::string> state_labels;
+        
+        /**
+         * The variable of each track: bit t of a character is the value of
+         * variable track_vars[t]. Automata built from formulas only have
+         * tracks for the variables they use. If this is empty, track t is
+         * variable t.
+         */
+        std::vector<int> track_vars;
+        
+        /**
+         * Facts about the states which Safra's construction may use (see the
+         * SAFRA_* settings in SafraTree.hpp); empty until find_safra_hints()
+         * is called. simulators[q] holds the states other than q which
+         * directly simulate q.
+         */
+        std::vector<state_set_t> simulators;
+        state_set_t accepting_sinks;
+        state_set_t always_marked;
 
 
       /********************************* methods *********************************/
@@ -110,6 +168,27 @@ class NBW{
          * conditions.
          */
         static NBW* build_automaton(std::vector<Conjunction*> formula, Boundary conditions);
+        
+        /** Returns true IFF the automaton for the formula would be empty.
+         * Same answer as build_automaton(formula, conditions)->is_empty(),
+         * but when a disjunct ends with a negation its complement is never
+         * built: the complement is empty exactly when the automaton before
+         * the negation is universal.
+         */
+        static bool formula_is_empty(std::vector<Conjunction*> formula, Boundary conditions);
+        
+        /** Returns true if the formula is empty exactly when each of its
+         * disjuncts is, so that they can be checked separately (and in any
+         * order) with disjunct_is_empty. This fails only when the quantifiers
+         * shared by the disjuncts need a complement of their union.
+         */
+        static bool disjuncts_independent(const std::vector<Conjunction*>& formula);
+        
+        /** Returns true IFF the automaton for disjunct @param i of the
+         * formula is empty, leaving out the quantifiers it shares with the
+         * other disjuncts. Only meaningful if disjuncts_independent(formula).
+         */
+        static bool disjunct_is_empty(const std::vector<Conjunction*>& formula, int i, Boundary conditions);
        
         static NBW* disjoint_sum(NBW* one, NBW* two);
 
@@ -167,24 +246,130 @@ class NBW{
         /** Returns true IFF the language of the automaton is empty. */        
         bool is_empty();
         
+        /** Returns true IFF the automaton accepts every word. Determinizes
+         * the automaton and checks the Rabin automaton for a rejecting cycle,
+         * which is cheaper than checking the complement for emptiness.
+         * A deterministic or weak automaton is not determinized: its
+         * complement (see get_complement) is checked for emptiness instead.
+         * Not const because the automaton is trimmed first.
+         */
+        bool is_universal();
+        
         /*
          * Return a deterministic Rabin automaton accepting the same language;
          * uses Safra's construction.
          */
         DRW* determinize() const;        
+        
+        /*
+         * Return a deterministic Rabin automaton accepting the same language,
+         * built from the strongly connected components of this automaton. A
+         * run is accepting iff it ends up in one component and visits its
+         * final states infinitely often, so each state of the result is the
+         * set of reachable states together with the state of one tracker
+         * per component which can accept:
+         *   - the components in which every cycle is accepting (inherently
+         *     weak) share one breakpoint set, as in breakpoint_complement;
+         *   - in a component where each state has at most one successor
+         *     inside the component on each character, every run is kept
+         *     under a name, oldest first, and runs which merge keep the
+         *     older name;
+         *   - any other component gets a Safra tree over its own states,
+         *     whose root is the set of reachable states in the component.
+         * There is a Rabin pair for the breakpoint set and one for each name
+         * used by a tracker.
+         */
+        DRW* determinize_by_components() const;
+        
+        /*
+         * Fill in simulators, accepting_sinks and always_marked for the
+         * current transitions, as far as the SAFRA_* settings ask for them.
+         * Must be called again after the automaton is changed.
+         */
+        void find_safra_hints();
 
         /* 
          * Generate and return a Bchi automaton which accepts the complement 
-         * of the language accepted by this automaton. Uses determinization.
+         * of the language accepted by this automaton. Uses determinization,
+         * unless the trimmed automaton is already deterministic, or weak
+         * (see classify and WEAK_COMPLEMENT in SafraTree.hpp).
          * Not const because the automaton is trimmed first.
          */
         NBW* get_complement();
         
+        /* True if the automaton has one initial state and at most one
+         * transition from each state on each character.
+         */
+        bool is_deterministic() const;
+        
+        /*
+         * Complement a deterministic automaton without Safra's construction.
+         * Missing transitions are sent to a new rejecting sink. A word is
+         * rejected iff its run visits the final states finitely often, so
+         * the complement runs a copy of the automaton and at some point
+         * guesses that no final state will be visited again: it moves to a
+         * second copy which only has the other states (and the sink), and
+         * whose states all accept. At most 2 * size + 2 states.
+         */
+        NBW* deterministic_complement() const;
+        
+        /* Classify the automaton as terminal, weak or general (see
+         * AcceptanceType) from its strongly connected components.
+         */
+        AcceptanceType classify() const;
+        
+        /*
+         * Complement a terminal automaton with the subset construction: the
+         * complement tracks the set of states reachable on the input so far,
+         * which has to avoid the final states forever.
+         */
+        NBW* powerset_complement() const;
+        
+        /*
+         * Complement a weak automaton with the breakpoint construction of
+         * Miyano and Hayashi. A word is rejected iff every run visits the
+         * non-final states infinitely often. Each state is a pair (S, O) of
+         * the states reachable so far and those which have only been final
+         * since the last breakpoint (the last time O was empty); the
+         * complement accepts when O is empty. The result is deterministic.
+         */
+        NBW* breakpoint_complement() const;
+        
         /* 
          * Project a character. ("Erase" the track, or make the given track 
          * irrelevant to the behavior of the automaton.)
          */
         void project(int track_index);
+        
+        /* 
+         * Project the track of variable @param var, if the automaton has one
+         * (if not, the variable is already irrelevant).
+         */
+        void project_variable(int var);
+        
+        /*
+         * Project the tracks of all of the variables @param vars in one pass
+         * over the transition matrix, instead of one pass per variable.
+         */
+        void project_variables(const std::vector<int>& vars);
+        
+        /*
+         * Return an equivalent automaton over the tracks of the variables
+         * @param vars, which must include every variable in track_vars. The
+         * new tracks are irrelevant to the behavior of the automaton. Used to
+         * give automata over different variables a shared alphabet.
+         */
+        NBW* expand_tracks(const std::vector<int>& vars) const;
+        
+        /*
+         * Return an automaton over the tracks of every variable except those
+         * in @param vars: the removed tracks are projected and then dropped
+         * from the alphabet, which shrinks by half for each of them.
+         */
+        NBW* project_out(const std::vector<int>& vars) const;
+        
+        /* Return a deep copy of this automaton. */
+        NBW* copy() const;
 
         /* Remove any states which are not (accessible and coacdessible) and
          * condense the automaton accordingly. Has no effect if the size of the
@@ -205,11 +390,24 @@ class NBW{
          */
         NBW(int size, 
             int alphabet_size, 
-            std::vector<boost::tuple<int, int,int> > adjacency_list,
+            const std::vector<boost::tuple<int, int,int> >& adjacency_list,
             state_set_t initial,
             state_set_t final,
             std::vector<std::string> char_labels = std::vector<std::string>(),
             std::vector<std::string> state_labels = std::vector<std::string>());
+        
+        /** Build an automaton from an adjacency list, keeping only the states
+         * which are accessible and coaccessible. The result is the same as
+         * constructing the whole automaton and calling trim(), but the
+         * transition matrix is only allocated for the states that are kept.
+         */
+        static NBW* build_trimmed(int size, 
+            int alphabet_size, 
+            const std::vector<boost::tuple<int, int,int> >& adjacency_list,
+            const state_set_t& initial,
+            const state_set_t& final,
+            const std::vector<std::string>& char_labels = std::vector<std::string>(),
+            const std::vector<std::string>& state_labels = std::vector<std::string>());
             
         ~NBW();
 };
@@ -37,6 +37,7 @@ SafraTree::SafraTree(int buchi_size, int alphabet_size){
     for (int i = 0; i < 2*buchi_size; i++)
         node_storage[i].tree = NULL;
         
+    this->ref_index = references.size();
     references.push_back(this);
 }
 
@@ -55,6 +56,15 @@ void SafraTree::reset(){
     SafraTree::trees.clear();
 }
 
+void SafraTree::release(SafraTree* tree){
+    // swap the last reference into the vacated slot
+    SafraTree* last = SafraTree::references.back();
+    SafraTree::references[tree->ref_index] = last;
+    last->ref_index = tree->ref_index;
+    SafraTree::references.pop_back();
+    delete tree;
+}
+
 bool SafraTree::operator==(const SafraTree& other) const {
     if((this->root == NULL) || (other.root == NULL))
         return (this->root == NULL) && (other.root == NULL);
@@ -63,6 +73,8 @@ bool SafraTree::operator==(const SafraTree& other) const {
             return false;
         if(this->used_node_names != other.used_node_names)
             return false;
+        if(this->marked_nodes != other.marked_nodes)
+            return false;
         return (*(this->root) == *(other.root));        
     }
 }
@@ -95,7 +107,10 @@ inline void SafraTree::free_temp_names(){
 }
 
 SafraTree* SafraTree::build_initial_tree(const NBW& input){
-    state_set_t nbw_initial_states = input.get_initial_states();
+    return build_rooted_tree(input, input.get_initial_states());
+}
+
+SafraTree* SafraTree::build_rooted_tree(const NBW& input, const state_set_t& nbw_initial_states){
     state_set_t nbw_final_states = input.get_final_states();
 
     SafraTree* ret = new SafraTree(input.size, input.alphabet_size);
@@ -115,6 +130,7 @@ SafraTree* SafraTree::build_initial_tree(const NBW& input){
         ret->root->marked = false;
     } else if (nbw_initial_states.is_subset_of(nbw_final_states)) {
         ret->root->marked = true;
+        ret->mark_node(ret->root->name);
     } else {
         ret->root->marked = false;
         
@@ -126,6 +142,7 @@ SafraTree* SafraTree::build_initial_tree(const NBW& input){
         child->tree = ret;
         child->states = copy;
         child->marked = true;
+        ret->mark_node(child->name);
         ret->root->children.push_back(child);
     }
     
@@ -139,8 +156,12 @@ SafraTree* SafraTree::build_initial_tree(const NBW& input){
  * Clone and transition a Safra tree.
  *
  */
-SafraTree* SafraTree::get_transition(const SafraTree& old_tree, const NBW& input, int character){
-    if(old_tree.root == NULL){
+SafraTree* SafraTree::get_transition(const SafraTree& old_tree, const NBW& input, int character,
+                                     const state_set_t* entering){
+    if(old_tree.root == NULL && entering != NULL && entering->any()){
+        // the tree was empty: the runs which just entered start a new one
+        return build_rooted_tree(input, *entering);
+    } else if(old_tree.root == NULL){
         SafraTree* ret = new SafraTree(input.size, input.alphabet_size);
         ret->root = NULL;
         ret->hvalue = 0;
@@ -151,7 +172,7 @@ SafraTree* SafraTree::get_transition(const SafraTree& old_tree, const NBW& input
         
         state_set_t kill_set(input.size);
                
-        old_tree.root->clone_spawn_and_transition(ret, input, character, true, kill_set, input.get_final_states());
+        old_tree.root->clone_spawn_and_transition(ret, input, character, true, kill_set, input.get_final_states(), entering);
 
         // precompute hash value
         if(ret->root == NULL){
@@ -216,6 +237,17 @@ SafraTree* SafraTree::get_tree(int i){
 
 /*** Implementation of SafraNode ***/
 
+/* Leave out the states of @param states which are directly simulated by a
+ * state of an older node (one in @param kill_set); see SAFRA_SIMULATION.
+ */
+static void prune_simulated(state_set_t& states, const state_set_t& kill_set, const NBW& input){
+    if(!SAFRA_SIMULATION || input.simulators.size() != states.size())
+        return;
+    for(int q = states.find_first(); q >= 0 && q < states.size(); q = states.find_next(q))
+        if(input.simulators[q].intersects(kill_set))
+            states.reset(q);
+}
+
 SafraNode::SafraNode(){
     this->marked = false;
 }
@@ -262,7 +294,8 @@ void SafraNode::accumulate_subtree_names(state_set_t& subtree_names){
  * Safra's construction. 
  * @return the new root node of the tree, or NULL if the tree (or subtree) is empty.
  */
-SafraNode* SafraNode::clone_spawn_and_transition(SafraTree* new_tree, const NBW& input, int character, bool root, state_set_t& kill_set, const state_set_t& nbw_final_states){    
+SafraNode* SafraNode::clone_spawn_and_transition(SafraTree* new_tree, const NBW& input, int character, bool root, state_set_t& kill_set, const state_set_t& nbw_final_states,
+                                                 const state_set_t* entering){    
     // clone this node, transitioning the labels
     void* new_node_loc = (void*)(new_tree->node_storage + (this->name-1));
     
@@ -277,11 +310,30 @@ SafraNode* SafraNode::clone_spawn_and_transition(SafraTree* new_tree, const NBW&
 
     // if(TRANSITION_FIRST) // Screw this; TRANSITION_FIRST is now mandatory.
     input.transition(ret->states, character);
+    if(root && entering != NULL)
+        ret->states |= *entering;
+    
+    /* Once some run reaches an accepting sink the word is accepted, and
+     * nothing else needs to be tracked.
+     */
+    if(root && SAFRA_ACCEPTING_SINKS && input.accepting_sinks.size() == ret->states.size()
+       && ret->states.intersects(input.accepting_sinks)){
+        ret->states &= input.accepting_sinks;
+        ret->marked = true;
+        new_tree->mark_node(ret->name);
+        for(int i = 0; i < this->children.size(); i++)
+            this->children[i]->accumulate_subtree_names(new_tree->temp_node_names);
+        new_tree->free_temp_names();
+        kill_set |= ret->states;
+        return ret;
+    }
         
     /** Perform the "eliminate states that my left siblings have, and kill me
      * if I'm empty" steps on the new root node of the subtree.
      */
-    if(ret->states.is_subset_of(kill_set)){  // Kill this subtree.
+    ret->states -= kill_set;
+    prune_simulated(ret->states, kill_set, input);
+    if(ret->states.none()){  // Kill this subtree.
         if(root)
             new_tree->root = NULL;
         else {
@@ -298,6 +350,21 @@ SafraNode* SafraNode::clone_spawn_and_transition(SafraTree* new_tree, const NBW&
         return NULL;
     }        
     
+    /* A node in the always-marked states would be marked below anyway,
+     * since all of its states are final: skip its children and new child.
+     */
+    if(SAFRA_ALWAYS_MARKED && input.always_marked.size() == ret->states.size()
+       && ret->states.is_subset_of(input.always_marked)){
+        ret->marked = true;
+        new_tree->mark_node(ret->name);
+        for(int i = 0; i < this->children.size(); i++)
+            this->children[i]->accumulate_subtree_names(new_tree->temp_node_names);
+        kill_set |= ret->states;
+        if(root)
+            new_tree->free_temp_names();
+        return ret;
+    }
+    
     /**
      * OK, this is a tricky bit. We want to create a child before recursing, so
      * that the nodes are named properly. However, we want to add it to the list
@@ -312,8 +379,6 @@ SafraNode* SafraNode::clone_spawn_and_transition(SafraTree* new_tree, const NBW&
      */
     int new_child_name = new_tree->name_node();
 
-    ret->states -= kill_set;
-
     // Recursion!
     std::vector<SafraNode*>::iterator iter = this->children.begin();
     
@@ -335,6 +400,7 @@ SafraNode* SafraNode::clone_spawn_and_transition(SafraTree* new_tree, const NBW&
     state_set_t new_child_states = ret->states;
     new_child_states &= nbw_final_states;
     new_child_states -= kill_set;
+    prune_simulated(new_child_states, kill_set, input);
     
     kill_set |= new_child_states;
     
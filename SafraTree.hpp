@@ -5,6 +5,7 @@
 #include <string>
 #include <boost/dynamic_bitset/dynamic_bitset.hpp>
 #include <boost/functional/hash.hpp>
+#include <boost/unordered_set.hpp>
 
 #include "utils.hpp"
 #include "NBW.hpp"
@@ -28,13 +29,64 @@
  */
 #define SAVE_TREE_DATA true
 
+/* Whether NBW::get_complement should complement the Safra construction on
+ * the fly (DRW::lazy_complement) instead of building the Rabin automaton,
+ * reducing its pairs and minimizing it before complementing. The lazy
+ * version never stores the Rabin automaton, but it has to keep one pair per
+ * Safra node name, so the complement usually has more states.
+ */
+#define LAZY_COMPLEMENT false
+
+/* Whether NBW::get_complement should skip the Safra construction for weak
+ * automata (see NBW::classify), complementing them with a subset or
+ * breakpoint construction instead.
+ */
+#define WEAK_COMPLEMENT true
+
+/* Whether NBW::get_complement and NBW::is_universal should determinize with
+ * NBW::determinize_by_components, which only uses Safra trees inside the
+ * strongly connected components that need them, instead of running Safra's
+ * construction over the whole automaton.
+ */
+#define DECOMPOSE_DETERMINIZATION true
+
+/* Optional changes to the transition of a Safra tree, which only take effect
+ * once NBW::find_safra_hints has been called on the automaton (as
+ * NBW::get_complement and NBW::is_universal do). Each can be switched off
+ * separately; with -v, find_safra_hints reports what it found.
+ *
+ * SAFRA_SIMULATION: a state is left out of a node (other than the root)
+ * when a state which directly simulates it is in an older node, since any
+ * accepting run from the first is matched by one from the second.
+ * Simulation is only computed for automata with at most
+ * SAFRA_SIMULATION_MAX_STATES states.
+ *
+ * SAFRA_ACCEPTING_SINKS: once the root holds a final state with a loop on
+ * every character, the word is accepted whatever follows, so the tree
+ * becomes a marked root holding only such states, with no children.
+ *
+ * SAFRA_ALWAYS_MARKED: a node whose states all lie in components which are
+ * deterministic and entirely final is marked at once, without transitioning
+ * its children or reserving a name for a new child.
+ */
+#define SAFRA_SIMULATION true
+#define SAFRA_SIMULATION_MAX_STATES 2000
+#define SAFRA_ACCEPTING_SINKS true
+#define SAFRA_ALWAYS_MARKED true
+
 class SafraTree{
   private:
   
     /* Keeps track of all instances of SafraTrees. These instances are deleted
-     * with a call to @function SafraTree::reset().
+     * with a call to @function SafraTree::reset(), or individually with a
+     * call to @function SafraTree::release().
      */
     static std::vector<SafraTree*> references;
+    
+    /* The position of this tree in @field references, so that a single tree
+     * can be released without searching the whole list.
+     */
+    int ref_index;
 
 
   public:
@@ -84,9 +136,28 @@ class SafraTree{
      *  determinizations.
      */
     static void reset();
+    
+    /** Delete a single tree right away instead of waiting for the next call
+     *  to @function SafraTree::reset(). Used during determinization to throw
+     *  away trees which turn out to duplicate a state that was already found.
+     *  The tree must not be referenced by any other tree.
+     */
+    static void release(SafraTree* tree);
 
     static SafraTree* build_initial_tree(const NBW& input_automaton);
-    static SafraTree* get_transition(const SafraTree& old_tree, const NBW& input, int character);
+    
+    /** Build a tree whose root is labeled by @param states, as the initial
+     *  tree is labeled by the initial states.
+     */
+    static SafraTree* build_rooted_tree(const NBW& input_automaton, const state_set_t& states);
+    
+    /** Transition @param old_tree on @param character. If @param entering is
+     *  given, its states are added to the label of the root right after the
+     *  labels are transitioned, as if some run of a larger automaton had just
+     *  moved into @param input (see NBW::determinize_by_components).
+     */
+    static SafraTree* get_transition(const SafraTree& old_tree, const NBW& input, int character,
+                                     const state_set_t* entering = NULL);
     
     /**
      * Get the SafraTree corresponding to state @param i. Only works if
@@ -179,7 +250,8 @@ class SafraNode{
      * Safra's construction. 
      * @return the new root node of the tree, or NULL if the tree (or subtree) is empty.
      */
-    SafraNode* clone_spawn_and_transition(SafraTree* new_tree, const NBW& input, int character, bool root, state_set_t& kill_set, const state_set_t& nbw_final_states);
+    SafraNode* clone_spawn_and_transition(SafraTree* new_tree, const NBW& input, int character, bool root, state_set_t& kill_set, const state_set_t& nbw_final_states,
+                                          const state_set_t* entering = NULL);
     
     /** Generate a string representation of the node -- the indent level is used
      * since this function is recursive, so that the tree is printed with an
@@ -229,5 +301,10 @@ struct stp_eq_t
     }
 };
 
+/**
+ * Hash set type used for hashing SafraTrees.
+ */
+typedef boost::unordered_set<SafraTree*, stp_hash_t, stp_eq_t> stree_set_t;
+
 
 #endif
\ No newline at end of file
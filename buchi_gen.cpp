@@ -4,6 +4,7 @@
  * Generates Buchi automata to check properties of elementary cellular automata.
  */
 
+#include <algorithm>
 #include <vector>
 
 #include <boost/dynamic_bitset.hpp>
@@ -17,10 +18,16 @@
 
 int initial_state_id;
 
+/* The real states in state_list (everything except the sink and the initial
+ * state), indexed by their fields.
+ */
+bstate_set_t state_index;
+
 // initialize static members
 std::vector<BuchiState*> BuchiState::state_list;
 int BuchiState::next_state_id;
 Conjunction BuchiState::current_formula; // needs to be reset
+CompiledConjunction BuchiState::compiled_formula;
 int BuchiState::formula_tracks;
 
 /*************** Implementation of BuchiState ***********************/
@@ -35,26 +42,34 @@ void BuchiState::cleanup(){
     for(int i = 0; i < state_list.size(); i++)
         delete state_list[i];
     state_list.clear();
+    state_index.clear();
 }
 
-void BuchiState::initialize(const Conjunction& f){
-    BuchiState::formula_tracks = SymbolTable::var_count();
+void BuchiState::initialize(const Conjunction& f, const std::vector<int>& vars){
+    BuchiState::formula_tracks = vars.size();
+    std::vector<int> track_of_var(SymbolTable::var_count(), -1);
+    for(int t = 0; t < vars.size(); t++)
+        track_of_var[vars[t]] = t;
 
     for(int i = 0; i < state_list.size(); i++)
         delete state_list[i];
     state_list.clear();
+    state_index.clear();
     next_state_id = 0;
     BuchiState::current_formula = f;
+    BuchiState::compiled_formula = CompiledConjunction(f, track_of_var);
     BuchiState* sink = new BuchiState();
     sink->state_id = next_state_id++; //TODO(jgershen): fix this to use a single initial state...
     sink->accept = false; sink->sink = true;
     sink->neg_lits_sat = bitvector(f.neg_literals.size());
+    sink->packed_old = sink->packed_current = 0;
     state_list.push_back(sink);
     
     BuchiState* initial_state = new BuchiState();
     initial_state->state_id = next_state_id++;
     initial_state->accept = false; initial_state->sink = false;
     initial_state->neg_lits_sat = bitvector(f.neg_literals.size());
+    initial_state->packed_old = initial_state->packed_current = 0;
     state_list.push_back(initial_state);
     initial_state_id = initial_state->state_id;
     
@@ -64,58 +79,347 @@ BuchiState* BuchiState::get_sink(){
     return state_list[0];
 }
 
+/* Combine the size and the blocks of @param bits into @param seed.
+ */
+static void hash_blocks(std::size_t& seed, const boost::dynamic_bitset<unsigned long>& bits){
+    boost::hash_combine(seed, bits.size());
+    if(bits.num_blocks() <= 1){
+        boost::hash_combine(seed, bits.none() ? 0UL : bits.to_ulong());
+    } else {
+        std::vector<unsigned long> blocks(bits.num_blocks());
+        boost::to_block_range(bits, blocks.begin());
+        boost::hash_range(seed, blocks.begin(), blocks.end());
+    }
+}
+
+std::size_t BuchiState::hash_value(const slice& x, const slice& y,
+                                   const bitvector& neg_lits_sat){
+    std::size_t seed = 0;
+    hash_blocks(seed, x);
+    hash_blocks(seed, y);
+    hash_blocks(seed, neg_lits_sat);
+    return seed;
+}
+
+BuchiState* BuchiState::find_state(const slice& x, const slice& y,
+                                     const bitvector& neg_lits_sat){
+    BuchiStateKey key(x, y, neg_lits_sat);
+    bstate_set_t::const_iterator loc = state_index.find(key, bsp_hash_t(), bsp_eq_t());
+    if(loc != state_index.end())
+        return *loc;
+    return NULL;
+}
+
 BuchiState* BuchiState::get_state(const slice& x, const slice& y,
                                     const bitvector& neg_lits_sat){
-    /* look for a previously created state with these attributes; ignore the sink
-     * and the initial state
+    /* look for a previously created state with these attributes; the sink
+     * and the initial state are not in the index
      */
-    for(int i = FIRST_REAL_STATE; i < state_list.size(); i++){
-        if( state_list[i]->old_slice == x 
-            && state_list[i]->current_slice == y 
-            && state_list[i]->neg_lits_sat == neg_lits_sat)
-            return state_list[i];    
-    }
+    BuchiStateKey key(x, y, neg_lits_sat);
+    bstate_set_t::iterator loc = state_index.find(key, bsp_hash_t(), bsp_eq_t());
+    if(loc != state_index.end())
+        return *loc;
+        
     BuchiState* new_state = new BuchiState();
     new_state->sink = false;
     new_state->state_id = next_state_id++;
     new_state->old_slice = x;
     new_state->current_slice = y;
+    new_state->packed_old = CompiledConjunction::pack(x);
+    new_state->packed_current = CompiledConjunction::pack(y);
     new_state->neg_lits_sat = neg_lits_sat;
+    new_state->hvalue = key.hvalue;
     new_state->accept = (neg_lits_sat.count() == current_formula.neg_literals.size());
-    std::string s1, s2;
-    boost::to_string(x,s1); boost::to_string(y,s2);
     state_list.push_back(new_state);
+    state_index.insert(new_state);
     
     return new_state;
 }
 
-BuchiState* BuchiState::get_target(slice next_slice){
-    bool pos_lits_ok = current_formula.check(this->old_slice, this->current_slice, next_slice);
+BuchiState* BuchiState::get_target(const slice& next_slice){
+    const CompiledConjunction& f = BuchiState::compiled_formula;
+    unsigned long x = this->packed_old;
+    unsigned long y = this->packed_current;
+    unsigned long z = CompiledConjunction::pack(next_slice);
     
-    if(pos_lits_ok){
+    if(!f.check(x, y, z))
+        return BuchiState::get_sink();
+    
+    int n = f.neg_literals.size();
+    if(n <= 64){
+        // only build a new set of satisfied literals if it grows
+        unsigned long old_sat = CompiledConjunction::pack(this->neg_lits_sat);
+        unsigned long new_sat = old_sat | f.neg_lits_sat(x, y, z);
+        if(new_sat == old_sat)
+            return BuchiState::get_state(this->current_slice, next_slice, this->neg_lits_sat);
+        return BuchiState::get_state(this->current_slice, next_slice, bitvector(n, new_sat));
+    } else {
         bitvector neg_lits_sat = bitvector(this->neg_lits_sat);
-        for(int i = 0; i < current_formula.neg_literals.size(); i++){
-            if(! current_formula.neg_literals[i]->check(this->old_slice, this->current_slice, next_slice))
+        for(int i = 0; i < n; i++){
+            if(!CompiledConjunction::holds(f.neg_literals[i], x, y, z))
                 neg_lits_sat.set(i);
         }
         return BuchiState::get_state(this->current_slice, next_slice, neg_lits_sat);
-    }else{   
-        return BuchiState::get_sink();
     }
 }
 
 
 
+void BuchiState::get_targets(const std::vector<slice>& characters, 
+                             std::vector<BuchiState*>& targets){
+    std::vector<bitvector> new_neg_lits;
+    this->find_targets(characters, targets, new_neg_lits);
+    this->add_targets(characters, targets, new_neg_lits);
+}
+
+void BuchiState::find_targets(const std::vector<slice>& characters, 
+                              std::vector<BuchiState*>& targets,
+                              std::vector<bitvector>& new_neg_lits) const{
+    const CompiledConjunction& f = BuchiState::compiled_formula;
+    std::vector<unsigned long> pass;
+    std::vector<unsigned long> neg_sat;
+    f.evaluate_row(this->packed_old, this->packed_current, BuchiState::formula_tracks, pass, neg_sat);
+    
+    int n = f.neg_literals.size();
+    int words = pass.size();
+    unsigned long old_sat = (n <= 64) ? CompiledConjunction::pack(this->neg_lits_sat) : 0UL;
+    targets.assign(characters.size(), (BuchiState*)NULL);
+    new_neg_lits.resize(characters.size());
+    
+    for(int c = 0; c < characters.size(); c++){
+        int w = c / 64;
+        unsigned long bit = 1UL << (c % 64);
+        if(!(pass[w] & bit)){
+            targets[c] = BuchiState::get_sink();
+            continue;
+        } 
+        
+        BuchiState* found;
+        if(n <= 64){
+            // only build a new set of satisfied literals if it grows
+            unsigned long new_sat = old_sat;
+            for(int i = 0; i < n; i++)
+                if(neg_sat[i * words + w] & bit)
+                    new_sat |= (1UL << i);
+            if(new_sat == old_sat){
+                found = BuchiState::find_state(this->current_slice, characters[c], this->neg_lits_sat);
+                if(found == NULL)
+                    new_neg_lits[c] = this->neg_lits_sat;
+            } else {
+                bitvector neg_lits_sat(n, new_sat);
+                found = BuchiState::find_state(this->current_slice, characters[c], neg_lits_sat);
+                if(found == NULL)
+                    new_neg_lits[c].swap(neg_lits_sat);
+            }
+        } else {
+            bitvector neg_lits_sat = bitvector(this->neg_lits_sat);
+            for(int i = 0; i < n; i++)
+                if(neg_sat[i * words + w] & bit)
+                    neg_lits_sat.set(i);
+            found = BuchiState::find_state(this->current_slice, characters[c], neg_lits_sat);
+            if(found == NULL)
+                new_neg_lits[c].swap(neg_lits_sat);
+        }
+        targets[c] = found;
+    }
+}
+
+void BuchiState::add_targets(const std::vector<slice>& characters, 
+                             std::vector<BuchiState*>& targets,
+                             const std::vector<bitvector>& new_neg_lits) const{
+    for(int c = 0; c < characters.size(); c++)
+        if(targets[c] == NULL)
+            targets[c] = BuchiState::get_state(this->current_slice, characters[c], new_neg_lits[c]);
+}
+
+
+/*************** Implementation of AutomatonCache ***********************/
+
+std::list<AutomatonCache::Entry> AutomatonCache::entries;
+boost::unordered_map<std::string, std::list<AutomatonCache::Entry>::iterator> AutomatonCache::index;
+long AutomatonCache::cells = 0;
+
+/* The number of variable @param var in a key, numbering it if it is new. */
+static std::string renumber(int var, std::vector<int>& number, std::vector<int>& variables){
+    if(number[var] < 0){
+        number[var] = variables.size();
+        variables.push_back(var);
+    }
+    return INT_TO_STR(number[var]);
+}
+
+static std::string literal_key(const Literal& l, std::vector<int>& number, std::vector<int>& variables){
+    std::string key = renumber(l.i1, number, variables);
+    key += "-" + INT_TO_STR(l.eca.to_ulong()) + ">";
+    key += renumber(l.i2, number, variables);
+    return key;
+}
+
+std::string AutomatonCache::key(const Conjunction& f, int first, Boundary conditions,
+                                std::vector<int>& variables){
+    variables.clear();
+    std::vector<int> number(SymbolTable::var_count(), -1);
+    std::string key = (conditions == OMEGA) ? "O" : "Z";
+    for(int i = first; i < f.quantifiers.size(); i++){
+        key += f.quantifiers[i].negated ? " ~" : " ";
+        key += f.quantifiers[i].universal ? "A" : "E";
+        key += renumber(f.quantifiers[i].variable_index, number, variables);
+    }
+    key += " :";
+    for(int i = 0; i < f.literals.size(); i++)
+        key += " " + literal_key(*f.literals[i], number, variables);
+    key += " :";
+    for(int i = 0; i < f.neg_literals.size(); i++)
+        key += " " + literal_key(*f.neg_literals[i], number, variables);
+    return key;
+}
+
+NBW* AutomatonCache::find(const std::string& key, const std::vector<int>& variables){
+    if(AUTOMATON_CACHE_CELLS == 0)
+        return NULL;
+    boost::unordered_map<std::string, std::list<Entry>::iterator>::iterator loc = index.find(key);
+    if(loc == index.end())
+        return NULL;
+    entries.splice(entries.begin(), entries, loc->second); // now most recently used
+    
+    NBW* ret = loc->second->nbw->copy();
+    for(int t = 0; t < ret->track_vars.size(); t++)
+        ret->track_vars[t] = variables[ret->track_vars[t]];
+    return ret;
+}
+
+void AutomatonCache::store(const std::string& key, const std::vector<int>& variables, const NBW& nbw){
+    long nbw_cells = (long)nbw.size * nbw.alphabet_size;
+    if(nbw_cells > AUTOMATON_CACHE_CELLS || index.find(key) != index.end())
+        return;
+    
+    Entry entry;
+    entry.key = key;
+    entry.nbw = nbw.copy();
+    entry.cells = nbw_cells;
+    for(int t = 0; t < entry.nbw->track_vars.size(); t++){
+        int var = entry.nbw->track_vars[t];
+        entry.nbw->track_vars[t] = std::find(variables.begin(), variables.end(), var) - variables.begin();
+        assert(entry.nbw->track_vars[t] < variables.size());
+    }
+    entries.push_front(entry);
+    index[key] = entries.begin();
+    cells += nbw_cells;
+    
+    while(cells > AUTOMATON_CACHE_CELLS){
+        cells -= entries.back().cells;
+        index.erase(entries.back().key);
+        delete entries.back().nbw;
+        entries.pop_back();
+    }
+}
+
+void AutomatonCache::clear(){
+    for(std::list<Entry>::iterator i = entries.begin(); i != entries.end(); i++)
+        delete i->nbw;
+    entries.clear();
+    index.clear();
+    cells = 0;
+}
+
+/*************** Construction of formula automata ***********************/
+
+/* The number of quantifiers shared by every disjunct of @param formula
+ * (see Conjunction::shared_quantifiers), or 0 if there is only one.
+ */
+static int shared_prefix(const std::vector<Conjunction*>& formula){
+    if(formula.size() <= 1)
+        return 0;
+    int shared = formula[0]->shared_quantifiers;
+    for(int i = 1; i < formula.size(); i++)
+        shared = std::min(shared, formula[i]->shared_quantifiers);
+    return shared;
+}
+
 NBW* NBW::build_automaton(std::vector<Conjunction*> formula, Boundary conditions){
-    NBW* ret = build_conjunction_automaton(*formula[0], conditions);
-    for(int i = 1; i < formula.size(); i++){
-        NBW* tmp = build_conjunction_automaton(*formula[i], conditions);
-        NBW* sum = NBW::disjoint_sum(ret,tmp);
+    return build_formula(formula, conditions);
+}
+
+/* The disjuncts are built without the quantifiers they share, then summed,
+ * and the shared quantifiers are applied once to the sum: projection
+ * distributes over union, and a complement in the shared quantifiers runs
+ * once instead of once per disjunct.
+ */
+NBW* NBW::build_formula(const std::vector<Conjunction*>& formula, Boundary conditions, bool* needs_negated){
+    int shared = shared_prefix(formula);
+    
+    std::vector<NBW*> disjuncts;
+    for(int i = 0; i < formula.size(); i++)
+        disjuncts.push_back(build_conjunction_automaton(*formula[i], conditions, NULL, shared));
+    
+    /* Each disjunct only has tracks for its own variables; the sum needs
+     * the union of them.
+     */
+    std::vector<int> vars;
+    for(int i = 0; i < disjuncts.size(); i++)
+        vars.insert(vars.end(), disjuncts[i]->track_vars.begin(), disjuncts[i]->track_vars.end());
+    std::sort(vars.begin(), vars.end());
+    vars.erase(std::unique(vars.begin(), vars.end()), vars.end());
+    for(int i = 0; i < disjuncts.size() && disjuncts.size() > 1; i++){
+        if(disjuncts[i]->track_vars != vars){
+            NBW* expanded = disjuncts[i]->expand_tracks(vars);
+            delete disjuncts[i];
+            disjuncts[i] = expanded;
+        }
+    }
+    
+    NBW* ret = disjuncts[0];
+    for(int i = 1; i < disjuncts.size(); i++){
+        NBW* sum = NBW::disjoint_sum(ret, disjuncts[i]);
         delete ret;
-        delete tmp;
+        delete disjuncts[i];
         ret = sum;
     }
-    return ret;
+    
+    std::vector<QuantifierBlock> blocks;
+    bool negate_result = false;
+    if(shared > 0){
+        int complements = formula[0]->plan_quantifiers(0, shared, blocks, negate_result);
+        if(verbose_output)
+            printf("Quantifier plan for %d shared quantifiers: %d blocks, %d complements\n", 
+                   shared, (int)blocks.size(), complements);
+    }
+    ret = apply_quantifier_blocks(ret, blocks, 0, blocks.size());
+    return apply_negation(ret, negate_result, needs_negated);
+}
+
+bool NBW::disjuncts_independent(const std::vector<Conjunction*>& formula){
+    int shared = shared_prefix(formula);
+    if(shared == 0)
+        return true;
+    // projections do not change emptiness, but a complement would
+    std::vector<QuantifierBlock> blocks;
+    bool negate_result;
+    return formula[0]->plan_quantifiers(0, shared, blocks, negate_result) == 0;
+}
+
+bool NBW::disjunct_is_empty(const std::vector<Conjunction*>& formula, int i, Boundary conditions){
+    bool needs_negated;
+    NBW* nbw = build_conjunction_automaton(*formula[i], conditions, &needs_negated, shared_prefix(formula));
+    bool empty = needs_negated ? nbw->is_universal() : nbw->is_empty();
+    delete nbw;
+    return empty;
+}
+
+bool NBW::formula_is_empty(std::vector<Conjunction*> formula, Boundary conditions){
+    if(!disjuncts_independent(formula)){
+        bool needs_negated;
+        NBW* nbw = build_formula(formula, conditions, &needs_negated);
+        bool empty = needs_negated ? nbw->is_universal() : nbw->is_empty();
+        delete nbw;
+        return empty;
+    }
+    
+    // the union is empty iff every disjunct is
+    for(int i = 0; i < formula.size(); i++)
+        if(!disjunct_is_empty(formula, i, conditions))
+            return false;
+    return true;
 }
 
 
@@ -123,7 +427,20 @@ NBW* NBW::build_automaton(std::vector<Conjunction*> formula, Boundary conditions
  * handle negative literals, either.
  */
 NBW* NBW::build_helper(const Conjunction& f, Boundary conditions){
-    BuchiState::initialize(f);
+    /* Only the variables which appear in the literals get a track, so that
+     * the alphabet does not grow with the variables of other disjuncts.
+     */
+    std::string cache_key;
+    std::vector<int> cache_vars;
+    if(AUTOMATON_CACHE_CELLS > 0){
+        cache_key = AutomatonCache::key(f, f.quantifiers.size(), conditions, cache_vars);
+        NBW* cached = AutomatonCache::find(cache_key, cache_vars);
+        if(cached != NULL)
+            return cached;
+    }
+    
+    std::vector<int> vars = f.variables();
+    BuchiState::initialize(f, vars);
 
     /* 
      * Generate all characters in the alphabet and put them in a vector.
@@ -160,14 +477,28 @@ NBW* NBW::build_helper(const Conjunction& f, Boundary conditions){
         
         int max = work_queue.size();
 
-        // calculate Buchi transitions
+        /* Calculate Buchi transitions, a whole row at a time. The rows of
+         * the level are evaluated in parallel, looking up the targets which
+         * already exist; new targets are then created serially, in the same
+         * order as a serial build would create them, so that state ids do
+         * not depend on the number of threads.
+         */
+        std::vector< std::vector<BuchiState*> > rows(max);
+        std::vector< std::vector<bitvector> > new_neg_lits(max);
+        #pragma omp parallel for schedule(dynamic, 16)
+        for(int i = 0; i < max; i++)
+            work_queue[i]->find_targets(characters, rows[i], new_neg_lits[i]);
+        
         for(int i = 0; i < max; i++){
+            int x = BuchiState::next_state_id;                    
+            std::vector<BuchiState*>& targets = rows[i];
+            work_queue[i]->add_targets(characters, targets, new_neg_lits[i]);
             for(int j = 0; j < characters.size(); j++){
-                int x = BuchiState::next_state_id;                    
-                BuchiState* new_state = work_queue[i]->get_target(characters[j]);
+                BuchiState* new_state = targets[j];
                 adjacency_list.push_back(boost::make_tuple(work_queue[i]->state_id, j, new_state->state_id));
-                if(x < BuchiState::next_state_id){ // state is new
+                if(new_state->state_id >= x){ // state is new
                     new_work_queue.push_back(new_state);
+                    x = new_state->state_id + 1;
                 }
             }
         }
@@ -222,90 +553,218 @@ NBW* NBW::build_helper(const Conjunction& f, Boundary conditions){
                    char_labels,
                    state_labels);
 
+    ret->track_vars = vars;
+
     // Free memory & data structures & things
     BuchiState::cleanup();
     
+    if(AUTOMATON_CACHE_CELLS > 0)
+        AutomatonCache::store(cache_key, cache_vars, *ret);
+    
     return ret;
 }
 
 
 
-NBW* NBW::build_conjunction_automaton(const Conjunction& f, Boundary conditions){        
-    NBW* ret = build_helper(f, conditions);
+/* The automaton of each literal only has tracks for its own variables, and
+ * the literals are added in a greedy order: first the one which lets the
+ * most variables be projected, then the one sharing the most variables with
+ * the automaton so far. Since a variable is projected (and its track
+ * dropped) once the automaton holds every literal which mentions it, the
+ * intermediate automata stay over a few tracks.
+ */
+NBW* NBW::build_partitioned(const Conjunction& f, const std::vector<int>& early_vars){
+    std::vector<Conjunction> parts;
+    for(int i = 0; i < f.literals.size(); i++){
+        Conjunction part;
+        part.literals.push_back(f.literals[i]);
+        parts.push_back(part);
+    }
+    for(int i = 0; i < f.neg_literals.size(); i++){
+        Conjunction part;
+        part.neg_literals.push_back(f.neg_literals[i]);
+        parts.push_back(part);
+    }
+    std::vector< std::vector<int> > part_vars;
+    for(int i = 0; i < parts.size(); i++)
+        part_vars.push_back(parts[i].variables());
     
-    bool current_formula_needs_negated = false; // for double negatives
+    // how many unused parts mention each variable
+    std::vector<int> mentions(SymbolTable::var_count(), 0);
+    for(int i = 0; i < parts.size(); i++)
+        for(int j = 0; j < part_vars[i].size(); j++)
+            mentions[part_vars[i][j]]++;
+    std::vector<bool> early(SymbolTable::var_count(), false);
+    for(int i = 0; i < early_vars.size(); i++)
+        early[early_vars[i]] = true;
     
-    // Handle quantifiers here
-    for(int i = f.quantifiers.size() - 1; i >= 0; i--){
-        if(f.quantifiers[i].universal){ // universal quantifiers w/negs
-            if(f.quantifiers[i].negated){
-                if(current_formula_needs_negated){
-                    // ~Ax ~foo --> Ex foo
-                    current_formula_needs_negated = false;
-                    ret->project(f.quantifiers[i].variable_index);                
-                } else {
-                    // ~Ax foo -> Ex ~foo
-                    current_formula_needs_negated = false;                
-                    NBW* not_foo = ret->get_complement();
-                    delete ret;
-                    ret = not_foo;
-                    ret->project(f.quantifiers[i].variable_index);
-                }
-            } else { // universal quantifiers w/o negation to immediate left
-                if(current_formula_needs_negated){
-                    // Ax ~foo -> ~Ex foo
-                    ret->project(f.quantifiers[i].variable_index);
-                    current_formula_needs_negated = true;                    
-                    // still needs negated
-                } else {
-                    // Ax foo --> ~Ex ~foo
-                    current_formula_needs_negated = true;
-                    NBW* not_foo = ret->get_complement();
-                    delete ret;
-                    ret = not_foo;
-                    ret->project(f.quantifiers[i].variable_index);                    
-                }
+    std::vector<bool> used(parts.size(), false);
+    NBW* ret = NULL;
+    for(int step = 0; step < parts.size(); step++){
+        int next = -1, best_closed = -1, best_shared = -1;
+        for(int i = 0; i < parts.size(); i++){
+            if(used[i]) continue;
+            int closed = 0, shared = 0;
+            for(int j = 0; j < part_vars[i].size(); j++){
+                int var = part_vars[i][j];
+                if(early[var] && mentions[var] == 1)
+                    closed++;
+                if(ret != NULL && std::find(ret->track_vars.begin(), ret->track_vars.end(), var) != ret->track_vars.end())
+                    shared++;
             }
-        } else { // existential quantifiers w/negs
-            if(f.quantifiers[i].negated){
-                if(current_formula_needs_negated){
-                    // ~Ex ~foo
-                    NBW* not_foo = ret->get_complement();
-                    delete ret;
-                    ret = not_foo;
-                    ret->project(f.quantifiers[i].variable_index);                  
-                    current_formula_needs_negated = true;
-                } else {
-                    // ~Ex foo
-                    ret->project(f.quantifiers[i].variable_index);
-                    current_formula_needs_negated = true;
-                }
-            } else { // existential quantifiers w/o negs
-                if(current_formula_needs_negated){
-                    // Ex ~foo
-                    NBW* not_foo = ret->get_complement();
-                    delete ret;
-                    ret = not_foo;
-                    ret->project(f.quantifiers[i].variable_index);                  
-                    current_formula_needs_negated = false;
-                } else {
-                    // Ex foo
-                    ret->project(f.quantifiers[i].variable_index);
-                    current_formula_needs_negated = false;
-                }
+            if(closed > best_closed || (closed == best_closed && shared > best_shared)){
+                next = i; best_closed = closed; best_shared = shared;
             }
         }
+        used[next] = true;
+        for(int j = 0; j < part_vars[next].size(); j++)
+            mentions[part_vars[next][j]]--;
         
-        ret->trim(); // trim between each cycle
-    } // move on to next quantifier
+        NBW* part = build_helper(parts[next], OMEGA);
+        if(ret == NULL){
+            ret = part;
+        } else {
+            std::vector<int> vars(ret->track_vars);
+            vars.insert(vars.end(), part->track_vars.begin(), part->track_vars.end());
+            std::sort(vars.begin(), vars.end());
+            vars.erase(std::unique(vars.begin(), vars.end()), vars.end());
+            if(ret->track_vars != vars){
+                NBW* expanded = ret->expand_tracks(vars);
+                delete ret;
+                ret = expanded;
+            }
+            if(part->track_vars != vars){
+                NBW* expanded = part->expand_tracks(vars);
+                delete part;
+                part = expanded;
+            }
+            NBW* both = NBW::intersection(ret, part);
+            delete ret;
+            delete part;
+            ret = both;
+        }
+        
+        std::vector<int> finished;
+        for(int j = 0; j < ret->track_vars.size(); j++)
+            if(early[ret->track_vars[j]] && mentions[ret->track_vars[j]] == 0)
+                finished.push_back(ret->track_vars[j]);
+        if(!finished.empty()){
+            NBW* projected = ret->project_out(finished);
+            delete ret;
+            ret = projected;
+        }
+        ret->trim();
+        
+        if(verbose_output)
+            printf("Partitioned conjunction: %d of %d literals, %d states over %d tracks\n", 
+                   step + 1, (int)parts.size(), ret->size, (int)ret->track_vars.size());
+        if(ret->is_empty())
+            break; // the other literals cannot make it any emptier
+    }
     
+    return ret;
+}
+
+/* Apply @param blocks from @param first_block up to (not including)
+ * @param last_block to @param ret, which is consumed: each block complements
+ * the automaton if it has to, then projects all of its variables at once
+ * and trims once.
+ */
+NBW* NBW::apply_quantifier_blocks(NBW* ret, const std::vector<QuantifierBlock>& blocks, 
+                                  int first_block, int last_block){
+    for(int i = first_block; i < last_block; i++){
+        if(blocks[i].complement_first){
+            NBW* complement = ret->get_complement();
+            delete ret;
+            ret = complement;
+        }
+        ret->project_variables(blocks[i].variables);
+        ret->trim(); // trim between each block
+    }
+    return ret;
+}
+
+/* Complement @param ret (which is consumed) if @param negate_result is set.
+ * If @param needs_negated is not NULL, the negation is not applied: the
+ * uncomplemented automaton is returned and *needs_negated tells the caller
+ * whether to complement it.
+ */
+NBW* NBW::apply_negation(NBW* ret, bool negate_result, bool* needs_negated){
     // negation propogated to topmost level
-    if(current_formula_needs_negated){
+    if(needs_negated != NULL){
+        *needs_negated = negate_result;
+    } else if(negate_result){
         NBW* not_foo = ret->get_complement();
         delete ret;
         ret = not_foo;
         ret->trim();
     }
-    
     return ret;
 }
+
+/* Keep @param nbw, the automaton for the quantifiers of @param f from
+ * @param start on, in the AutomatonCache.
+ */
+static void store_block(const Conjunction& f, int start, Boundary conditions, const NBW& nbw){
+    if(AUTOMATON_CACHE_CELLS == 0)
+        return;
+    std::vector<int> cache_vars;
+    std::string cache_key = AutomatonCache::key(f, start, conditions, cache_vars);
+    AutomatonCache::store(cache_key, cache_vars, nbw);
+}
+
+/* The quantifiers of @param f from index @param outer on are applied in the
+ * blocks planned by Conjunction::plan_quantifiers; the outer ones are left
+ * to the caller. For @param needs_negated see apply_negation.
+ * The automaton after each block is kept in the AutomatonCache, and the
+ * construction starts from the largest suffix of the blocks found there.
+ */
+NBW* NBW::build_conjunction_automaton(const Conjunction& f, Boundary conditions, bool* needs_negated, int outer){        
+    std::vector<QuantifierBlock> blocks;
+    bool negate_result;
+    int complements = f.plan_quantifiers(outer, f.quantifiers.size(), blocks, negate_result);
+    if(verbose_output)
+        printf("Quantifier plan for %s: %d blocks, %d complements\n", 
+               f.to_string().c_str(), (int)blocks.size(), complements);
+    
+    // block i ends with quantifier block_start[i]
+    std::vector<int> block_start(blocks.size());
+    int start = f.quantifiers.size();
+    for(int i = 0; i < blocks.size(); i++){
+        start -= blocks[i].variables.size();
+        block_start[i] = start;
+    }
+    
+    NBW* ret = NULL;
+    int first_block = 0;
+    for(int i = blocks.size() - 1; i >= 0 && ret == NULL && AUTOMATON_CACHE_CELLS > 0; i--){
+        std::vector<int> cache_vars;
+        ret = AutomatonCache::find(AutomatonCache::key(f, block_start[i], conditions, cache_vars), cache_vars);
+        first_block = i + 1;
+    }
+    
+    /* The variables of an innermost block which needs no complement are
+     * projected from the automaton of the literals itself, so they can be
+     * projected while it is being built.
+     */
+    if(ret != NULL){
+        if(verbose_output)
+            printf("Reusing the automaton for the innermost %d blocks\n", first_block);
+    } else if(PARTITION_CONJUNCTIONS && conditions == OMEGA && !blocks.empty() 
+              && !blocks[0].complement_first 
+              && f.literals.size() + f.neg_literals.size() > 1){
+        ret = build_partitioned(f, blocks[0].variables);
+        first_block = 1;
+        store_block(f, block_start[0], conditions, *ret);
+    } else {
+        ret = build_helper(f, conditions);
+        first_block = 0;
+    }
+    
+    for(int i = first_block; i < blocks.size(); i++){
+        ret = apply_quantifier_blocks(ret, blocks, i, i + 1);
+        store_block(f, block_start[i], conditions, *ret);
+    }
+    
+    return apply_negation(ret, negate_result, needs_negated);
+}
@@ -2,8 +2,12 @@
 #ifndef BUCHI_GEN_H
 #define BUCHI_GEN_H
 
+#include <list>
+#include <string>
 #include <vector>
 #include <boost/dynamic_bitset.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 
 #include "logic.hpp"
 #include "utils.hpp"
@@ -13,6 +17,7 @@ class BuchiState
 {
     private:
         static Conjunction current_formula;
+        static CompiledConjunction compiled_formula;
         static int next_state_id;
         static int formula_tracks;
     
@@ -32,23 +37,170 @@ class BuchiState
         slice old_slice;
         slice current_slice;
         
+        // The slices packed into words for the compiled formula.
+        unsigned long packed_old;
+        unsigned long packed_current;
+        
         bitvector neg_lits_sat;
+        
+        // Precomputed hash value of (old_slice, current_slice, neg_lits_sat).
+        std::size_t hvalue;
     
         static std::vector<BuchiState*> state_list;    
+        
+        /* Hash the blocks of the fields which identify a state. */
+        static std::size_t hash_value(const slice& x, const slice& y,
+                                      const bitvector& neg_lits_sat);
     
         BuchiState();
         ~BuchiState();
         
-        BuchiState* get_target(slice next_slice);
+        BuchiState* get_target(const slice& next_slice);
+        
+        /* The targets of this state on every character at once, in the
+         * order of @param characters (character c is the slice packed as c).
+         * Same result as calling get_target on each character, but the
+         * formula is evaluated for the whole alphabet in one pass.
+         */
+        void get_targets(const std::vector<slice>& characters, 
+                         std::vector<BuchiState*>& targets);
+        
+        /* The first half of get_targets, which only reads the state table
+         * and so may run in several threads at once: targets which already
+         * exist (or the sink) are stored in @param targets, and new targets
+         * are left NULL with their set of satisfied negative literals stored
+         * in @param new_neg_lits.
+         */
+        void find_targets(const std::vector<slice>& characters, 
+                          std::vector<BuchiState*>& targets,
+                          std::vector<bitvector>& new_neg_lits) const;
+        
+        /* The second half: create the new targets left by find_targets, in
+         * character order.
+         */
+        void add_targets(const std::vector<slice>& characters, 
+                         std::vector<BuchiState*>& targets,
+                         const std::vector<bitvector>& new_neg_lits) const;
         
         static void cleanup();
-        static void initialize(const Conjunction& f);
+        /* Start building an automaton for @param f over the tracks of the
+         * variables @param vars: track t of a slice is variable vars[t].
+         */
+        static void initialize(const Conjunction& f, const std::vector<int>& vars);
         
         static BuchiState* get_state(const slice& x, const slice& y,
                                     const bitvector& neg_lits_sat);
+        
+        /* Like get_state, but returns NULL instead of creating a new state.
+         */
+        static BuchiState* find_state(const slice& x, const slice& y,
+                                      const bitvector& neg_lits_sat);
         static BuchiState* get_sink();
         
         friend class NBW;
 };
 
+/** The fields of a state we are looking for, so that get_state() can search
+ * the table without building a BuchiState first.
+ */
+struct BuchiStateKey
+{
+    const slice& old_slice;
+    const slice& current_slice;
+    const bitvector& neg_lits_sat;
+    std::size_t hvalue;
+    
+    BuchiStateKey(const slice& x, const slice& y, const bitvector& n)
+        : old_slice(x), current_slice(y), neg_lits_sat(n),
+          hvalue(BuchiState::hash_value(x, y, n)) {}
+};
+
+/** A custom hash function for pointers to BuchiStates.
+ * Returns the precomputed hash of the state (or of a key).
+ */
+struct bsp_hash_t
+    : std::unary_function<BuchiState*, std::size_t>
+{
+    std::size_t operator()(BuchiState* const& bs_p) const
+    {
+        return bs_p->hvalue;       
+    }
+    std::size_t operator()(const BuchiStateKey& key) const
+    {
+        return key.hvalue;       
+    }
+};
+
+/** A custom equality comparison for pointers to BuchiStates.
+ * Returns true if the states have the same slices and negative literals.
+ */
+struct bsp_eq_t
+    : std::binary_function<BuchiState*, BuchiState*, bool>
+{
+    bool operator()(BuchiState* const& x, BuchiState* const& y) const
+    {
+        return x->old_slice == y->old_slice 
+            && x->current_slice == y->current_slice 
+            && x->neg_lits_sat == y->neg_lits_sat;
+    }
+    bool operator()(const BuchiStateKey& x, BuchiState* const& y) const
+    {
+        return x.old_slice == y->old_slice 
+            && x.current_slice == y->current_slice 
+            && x.neg_lits_sat == y->neg_lits_sat;
+    }
+    bool operator()(BuchiState* const& x, const BuchiStateKey& y) const
+    {
+        return (*this)(y, x);
+    }
+};
+
+/**
+ * Hash set type used for interning BuchiStates.
+ */
+typedef boost::unordered_set<BuchiState*, bsp_hash_t, bsp_eq_t> bstate_set_t;
+
+/**
+ * Automata built for conjunctions, kept for the rest of the process so that
+ * disjuncts and later formulas which need the same automaton reuse it
+ * (including the complements it took). An entry is the automaton for the
+ * quantifiers of a conjunction from some index on, applied to its literals,
+ * before any final negation. Keys are strings naming the boundary
+ * conditions, the literals with their ECAs and the quantifiers, with the
+ * variables renumbered in order of first appearance, so conjunctions which
+ * only differ in the names of their variables share an entry. Once the
+ * stored automata hold more than AUTOMATON_CACHE_CELLS (state, character)
+ * cells, the least recently used ones are dropped.
+ */
+class AutomatonCache
+{
+    private:
+        struct Entry{
+            std::string key;
+            NBW* nbw; // over the renumbered variables
+            long cells;
+        };
+        
+        static std::list<Entry> entries; // most recently used first
+        static boost::unordered_map<std::string, std::list<Entry>::iterator> index;
+        static long cells;
+    
+    public:
+        /* The key for quantifiers @param first to the end of @param f.
+         * @param variables gets the variable renumbered i at position i.
+         */
+        static std::string key(const Conjunction& f, int first, Boundary conditions,
+                               std::vector<int>& variables);
+        
+        /* A copy of the automaton stored under @param key, over the
+         * @param variables of the caller, or NULL if there is none.
+         */
+        static NBW* find(const std::string& key, const std::vector<int>& variables);
+        
+        /* Store a copy of @param nbw, whose tracks are for @param variables. */
+        static void store(const std::string& key, const std::vector<int>& variables, const NBW& nbw);
+        
+        static void clear();
+};
+
 #endif
\ No newline at end of file
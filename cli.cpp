@@ -1,10 +1,16 @@
 #include <iostream>
 #include <cstdio>
 #include <cstdlib>
+#include <cerrno>
 #include <cstring>
 #include <string>
 #include <vector>
 
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "NBW.hpp"
 #include "logic.hpp"
 #include "fol_parser.hpp"
@@ -27,8 +33,9 @@ void show_help( const bool verbose ){
     std::printf( "  -h, --help                   display this help and exit\n" );
     std::printf( "  -V, --version                output version information and exit\n" );
     std::printf( "  -e, --eca=<n>                set model to use ECA n.\n" );
-    std::printf( "  -f, --formula=\"<arg>\"        parse the formula instead of reading from stdin\n" );
+    std::printf( "  -f, --formula=\"<arg>\"        parse the formula instead of reading from stdin (may be repeated)\n" );
     std::printf( "  -Z, --zeta                   work with bi-infinite cellular automata (EXPERIMENTAL)\n" );    
+    std::printf( "  -r, --race                   check the disjuncts in parallel, stopping at the first nonempty one\n" );
     std::printf( "  -v, --verbose                verbose mode\n" );
 }
 
@@ -81,17 +88,146 @@ const char * optname( const int code, const Arg_parser::Option options[] ){
     return buf;
 }
 
+/* Check each disjunct of @param formula for emptiness in its own process
+ * and return true if they are all empty. As soon as one of them is found to
+ * be nonempty the others are killed. The constructions keep their state in
+ * static members, so separate processes are the simplest way to run them
+ * side by side. Requires NBW::disjuncts_independent(formula).
+ */
+bool race_disjuncts( const std::vector<Conjunction*>& formula, Boundary conditions ){
+    std::fflush( stdout );
+    std::vector<pid_t> children;
+    for( int i = 0; i < formula.size(); i++ ){
+        pid_t pid = fork();
+        if( pid == 0 )
+            std::_Exit( NBW::disjunct_is_empty( formula, i, conditions ) ? 0 : 1 );
+        if( pid < 0 ){
+            show_error( "fork failed", errno );
+            break;
+        }
+        children.push_back( pid );
+    }
+    
+    std::vector<bool> finished( formula.size(), false );
+    bool empty = true;
+    int running = children.size();
+    while( running > 0 && empty ){
+        int status;
+        pid_t pid = waitpid( -1, &status, 0 );
+        if( pid < 0 ) break;
+        for( int i = 0; i < children.size(); i++ ){
+            if( children[i] != pid ) continue;
+            running--;
+            if( WIFEXITED( status ) ){
+                finished[i] = true;
+                if( WEXITSTATUS( status ) != 0 ){
+                    if( verbose_output )
+                        std::printf( "Disjunct %d is nonempty\n", i );
+                    empty = false;
+                }
+            }
+        }
+    }
+    
+    for( int i = 0; i < children.size(); i++ ){
+        if( !finished[i] ) kill( children[i], SIGKILL );
+    }
+    while( waitpid( -1, 0, 0 ) > 0 );
+    
+    // disjuncts whose process could not be started or did not finish normally
+    for( int i = 0; i < formula.size() && empty; i++ ){
+        if( !finished[i] && !NBW::disjunct_is_empty( formula, i, conditions ) )
+            empty = false;
+    }
+    return empty;
+}
+
+/* Parse @param formula (or a formula from stdin, if it is empty), decide
+ * it and print the answer. Returns 1 if it is valid and 0 if not.
+ */
+int check_formula( const std::string& formula, Boundary conditions, bool race ){
+    if( formula.length() > 0 ) {
+        InputWrapper::set_input(formula);
+    } else {
+        std::cout << ">> ";
+    }
+    
+    int parse_errcode = InputWrapper::run_parser();
+    if( formula.length() > 0 )
+        InputWrapper::close();
+    if(parse_errcode){
+        fprintf(stderr, "Error parsing formula: %s\n", formula.c_str());    
+        std::exit(-1);
+    }
+        
+
+    std::vector<Conjunction*>* result = Conjunction::last_formula_parsed;
+    for(int i = 0; i < result->size(); i++) 
+        std::cout << result->at(i)->to_string() << std::endl;    
+
+
+
+    /* Check to make sure that the user is not trying to negate a zeta-automaton.
+     * This requires implementing a procedure in
+     *          Cellular automata, ωω-regular sets, and sofic systems
+     *              by Culik and Yu. See Discrete Applied Mathematics, 
+     *              Volume 32, Issue 2, 29 July 1991, Pages 85-101 
+     * Because of time constraints this is not yet a feature. 
+     */
+    if(conditions == ZETA){
+        for(int i = 0; i < result->size(); i++) {
+            for(int j = 0; j < result->at(i)->quantifiers.size(); j++) {
+                if(result->at(i)->quantifiers[j].negated){
+                    fprintf(stderr, "Error: negation not supported for zeta-automata.\n");
+                    std::exit(-1);
+                }
+            }
+        }
+        
+    }
+
+
+
+    Decision decision = Conjunction::simplify( *result );
+    if( verbose_output ){
+        std::cout << "Simplified:" << std::endl;
+        for( int i = 0; i < result->size() && decision == UNDECIDED; i++ ) 
+            std::cout << result->at(i)->to_string() << std::endl;
+    }
+
+    // the formula is valid if no counterexamples can be found
+    bool empty;
+    if( decision != UNDECIDED ){
+        if( verbose_output )
+            printf("Decided without building an automaton\n");
+        empty = (decision == DECIDED_FALSE);
+    } else if( race && result->size() > 1 && NBW::disjuncts_independent( *result ) )
+        empty = race_disjuncts( *result, conditions );
+    else
+        empty = NBW::formula_is_empty( *result, conditions );
+    int valid = empty ? 0 : 1;
+    if( valid )
+        printf("true\n");
+    else
+        printf("false\n");
+
+    return valid;  
+}
+
 } // end namespace
 
 
 int main( int argc, char **argv)
 {
     bool verbose = false;
+    bool race = false;
     invocation_name = argv[0];
     
     Boundary conditions = OMEGA;
 
-    std::string formula;
+    int eca = -1; // the last ECA given, if any
+    std::vector<std::string> formulas;
+    std::vector<int> ecas; // the ECA given before each formula
     
     
     const Arg_parser::Option options[] =
@@ -101,6 +237,7 @@ int main( int argc, char **argv)
         { 'f', "formula",   Arg_parser::yes },
         { 'h', "help",     Arg_parser::no    },
         { 'Z', "zeta",  Arg_parser::no    },
+        { 'r', "race",  Arg_parser::no    },
         { 'v', "verbose",  Arg_parser::no    },
         { 256, "orphan",   Arg_parser::no    },
         {   0, 0,          Arg_parser::no    } 
@@ -121,7 +258,8 @@ int main( int argc, char **argv)
                 return 0;
             case 'e':  // set eca
             {
-                Literal::set_default_eca(atoi(parser.argument(i).c_str()));
+                eca = atoi(parser.argument(i).c_str());
+                Literal::set_default_eca(eca);
                 break;			
             }
             case 'f':  // set formula
@@ -130,12 +268,14 @@ int main( int argc, char **argv)
                 std::string temp(parser.argument(i));
                 if(temp.at(temp.length()-1) != '\n')
                     temp.push_back('\n');
-                formula = temp;
+                formulas.push_back(temp);
+                ecas.push_back(eca);
                 break;
             }
             case 'h': show_help( verbose ); return 0;
             case 'Z': conditions = ZETA; break;
-            case 'v': verbose = true; break;
+            case 'r': race = true; break;
+            case 'v': verbose = true; verbose_output = true; break;
             case 256: break;				// example, do nothing
             default : internal_error( "uncaught option" );
         }
@@ -144,54 +284,18 @@ int main( int argc, char **argv)
     
     
     
-    if( formula.length() > 0 ) {
-        InputWrapper::set_input(formula);
-    } else {
-        std::cout << ">> ";
-    }
-    
-    int parse_errcode = InputWrapper::run_parser();
-    if(parse_errcode){
-        fprintf(stderr, "Error parsing formula: %s\n", formula.c_str());    
-        std::exit(-1);
-    }
-        
-
-    std::vector<Conjunction*>* result = Conjunction::last_formula_parsed;
-    for(int i = 0; i < result->size(); i++) 
-        std::cout << result->at(i)->to_string() << std::endl;    
-
-
-
-    /* Check to make sure that the user is not trying to negate a zeta-automaton.
-     * This requires implementing a procedure in
-     *          Cellular automata, ωω-regular sets, and sofic systems
-     *              by Culik and Yu. See Discrete Applied Mathematics, 
-     *              Volume 32, Issue 2, 29 July 1991, Pages 85-101 
-     * Because of time constraints this is not yet a feature. 
+    /* Every formula given with -f is checked in turn, with the ECA given
+     * last before it, so that the automata they have in common are only
+     * built once (see AutomatonCache). The exit status is that of the last.
      */
-    if(conditions == ZETA){
-        for(int i = 0; i < result->size(); i++) {
-            for(int j = 0; j < result->at(i)->quantifiers.size(); j++) {
-                if(result->at(i)->quantifiers[j].negated){
-                    fprintf(stderr, "Error: negation not supported for zeta-automata.\n");
-                    std::exit(-1);
-                }
-            }
-        }
-        
+    if( formulas.empty() ){
+        return check_formula( std::string(), conditions, race );
     }
-
-
-
-    NBW* nbw = NBW::build_automaton(*result, conditions);
-    int valid = nbw->is_empty() ? 0 : 1; // the formula is valid if no counterexamples can be found
-    if( valid )
-        printf("true\n");
-    else
-        printf("false\n");
-    
-    delete nbw;
-
-    return valid;  
+    int valid = 0;
+    for( int i = 0; i < formulas.size(); i++ ){
+        if( ecas[i] >= 0 )
+            Literal::set_default_eca( ecas[i] );
+        valid = check_formula( formulas[i], conditions, race );
+    }
+    return valid;
 }
@@ -1532,7 +1532,7 @@ yyreduce:
     { 
                                                    for(int j = (yyvsp[(1) - (4)].qlist)->size() - 1; j >= 0; j--){ 
                                                      for(int i = 0; i < (yyvsp[(3) - (4)].form)->size(); i++){ 
-                                                       (yyvsp[(3) - (4)].form)->at(i)->add_outer_quantifier((yyvsp[(1) - (4)].qlist)->at(j));
+                                                       (yyvsp[(3) - (4)].form)->at(i)->add_shared_quantifier((yyvsp[(1) - (4)].qlist)->at(j));
                                                      } 
                                                     } 
                                                    (yyval.form) = (yyvsp[(3) - (4)].form);
@@ -1,4 +1,5 @@
 #include "logic.hpp"
+#include <algorithm>
 #include <iostream>
 
 std::vector<Conjunction*>* Conjunction::last_formula_parsed;
@@ -52,6 +53,188 @@ void Conjunction::add_literal(Literal* l){
         this->literals.push_back(l);
 }
 
+std::vector<int> Conjunction::variables() const{
+    std::vector<int> vars;
+    for(int i = 0; i < this->literals.size(); i++){
+        vars.push_back(this->literals[i]->i1);
+        vars.push_back(this->literals[i]->i2);
+    }
+    for(int i = 0; i < this->neg_literals.size(); i++){
+        vars.push_back(this->neg_literals[i]->i1);
+        vars.push_back(this->neg_literals[i]->i2);
+    }
+    std::sort(vars.begin(), vars.end());
+    vars.erase(std::unique(vars.begin(), vars.end()), vars.end());
+    return vars;
+}
+
+int Conjunction::plan_quantifiers(int first, int last, 
+                                  std::vector<QuantifierBlock>& blocks, bool& negate_result) const{
+    blocks.clear();
+    int complements = 0;
+    bool holds_negation = false; // the automaton holds ~phi instead of phi
+    for(int i = last - 1; i >= first; i--){
+        const Quantifier& q = this->quantifiers[i];
+        // Ex phi projects phi, Ax phi = ~Ex ~phi projects ~phi
+        bool complement = (q.universal != holds_negation);
+        if(complement || blocks.empty()){
+            QuantifierBlock block;
+            block.complement_first = complement;
+            blocks.push_back(block);
+            if(complement)
+                complements++;
+        }
+        blocks.back().variables.push_back(q.variable_index);
+        holds_negation = (q.universal != q.negated);
+    }
+    negate_result = holds_negation;
+    if(negate_result)
+        complements++;
+    return complements;
+}
+
+/* Order on literals for simplify_literals. */
+static bool literal_less(const Literal* x, const Literal* y){
+    if(x->i1 != y->i1) return x->i1 < y->i1;
+    if(x->i2 != y->i2) return x->i2 < y->i2;
+    return x->eca.to_ulong() < y->eca.to_ulong();
+}
+
+static bool literal_same(const Literal* x, const Literal* y){
+    return x->i1 == y->i1 && x->i2 == y->i2 && x->eca == y->eca;
+}
+
+/* Put @param list in order without duplicates, dropping literals x==x.
+ * Returns false if one of them was x==x.
+ */
+static bool normalize_literals(std::vector<Literal*>& list){
+    bool trivial = false;
+    std::vector<Literal*> kept;
+    for(int i = 0; i < list.size(); i++){
+        Literal* l = list[i];
+        if(l->eca.to_ulong() == IDENTITY_ECA_NUM){
+            if(l->i1 == l->i2){
+                trivial = true;
+                continue;
+            }
+            if(l->i1 > l->i2)
+                std::swap(l->i1, l->i2);
+        }
+        kept.push_back(l);
+    }
+    std::sort(kept.begin(), kept.end(), literal_less);
+    kept.erase(std::unique(kept.begin(), kept.end(), literal_same), kept.end());
+    list.swap(kept);
+    return !trivial;
+}
+
+bool Conjunction::simplify_literals(){
+    normalize_literals(this->literals);
+    if(!normalize_literals(this->neg_literals))
+        return false; // ~(x==x)
+    for(int i = 0; i < this->neg_literals.size(); i++)
+        for(int j = 0; j < this->literals.size(); j++)
+            if(literal_same(this->neg_literals[i], this->literals[j]))
+                return false;
+    return true;
+}
+
+bool Conjunction::quantifier_is_dead(int i) const{
+    int var = this->quantifiers[i].variable_index;
+    for(int j = i + 1; j < this->quantifiers.size(); j++)
+        if(this->quantifiers[j].variable_index == var)
+            return true;
+    std::vector<int> vars = this->variables();
+    return !std::binary_search(vars.begin(), vars.end(), var);
+}
+
+bool Conjunction::drop_quantifier(int i, int first){
+    if(this->quantifiers[i].negated){
+        if(i - 1 < first)
+            return false;
+        Quantifier& outer = this->quantifiers[i - 1];
+        outer.negated = !outer.negated;
+        outer.universal = !outer.universal;
+    }
+    this->quantifiers.erase(this->quantifiers.begin() + i);
+    return true;
+}
+
+bool Conjunction::quantify_constant(int first, int last, bool value) const{
+    for(int i = last - 1; i >= first; i--)
+        if(this->quantifiers[i].negated)
+            value = !value;
+    return value;
+}
+
+static bool quantifier_less(const Quantifier& x, const Quantifier& y){
+    return x.variable_index < y.variable_index;
+}
+
+/* Sort each run of unnegated quantifiers of one kind in [first, last) by
+ * variable; such quantifiers commute.
+ */
+static void sort_quantifier_runs(std::vector<Quantifier>& quantifiers, int first, int last){
+    int run = first;
+    for(int i = first; i <= last; i++){
+        if(i == last || quantifiers[i].negated 
+           || quantifiers[i].universal != quantifiers[run].universal){
+            std::sort(quantifiers.begin() + run, quantifiers.begin() + i, quantifier_less);
+            run = (i < last && quantifiers[i].negated) ? i + 1 : i;
+        }
+    }
+}
+
+Decision Conjunction::simplify(std::vector<Conjunction*>& formula){
+    int shared = 0;
+    if(formula.size() > 1){
+        shared = formula[0]->shared_quantifiers;
+        for(int i = 1; i < formula.size(); i++)
+            shared = std::min(shared, formula[i]->shared_quantifiers);
+    }
+    
+    /* Each disjunct on its own, leaving the shared quantifiers alone. A
+     * disjunct without literals is a constant; a false one can be dropped,
+     * a true one makes the union true.
+     */
+    std::vector<Conjunction*> kept;
+    bool union_true = false;
+    for(int d = 0; d < formula.size(); d++){
+        Conjunction* c = formula[d];
+        bool satisfiable = c->simplify_literals();
+        if(!satisfiable || (c->literals.empty() && c->neg_literals.empty())){
+            if(c->quantify_constant(shared, c->quantifiers.size(), satisfiable))
+                union_true = true;
+            continue;
+        }
+        for(int i = c->quantifiers.size() - 1; i >= shared; i--)
+            if(c->quantifier_is_dead(i))
+                c->drop_quantifier(i, shared);
+        sort_quantifier_runs(c->quantifiers, shared, c->quantifiers.size());
+        kept.push_back(c);
+    }
+    if(union_true || kept.empty())
+        return formula[0]->quantify_constant(0, shared, union_true) ? DECIDED_TRUE : DECIDED_FALSE;
+    formula.swap(kept);
+    
+    // shared quantifiers which are dead in every disjunct
+    for(int i = shared - 1; i >= 0; i--){
+        bool dead = true;
+        for(int d = 0; d < formula.size() && dead; d++)
+            dead = formula[d]->quantifier_is_dead(i);
+        if(!dead || (formula[0]->quantifiers[i].negated && i == 0))
+            continue;
+        for(int d = 0; d < formula.size(); d++){
+            formula[d]->drop_quantifier(i, 0);
+            formula[d]->shared_quantifiers--;
+        }
+        shared--;
+    }
+    for(int d = 0; d < formula.size(); d++)
+        sort_quantifier_runs(formula[d]->quantifiers, 0, shared);
+    return UNDECIDED;
+}
+
 void Conjunction::add_inner_quantifier(const Quantifier& q){
     this->quantifiers.push_back(q);
 }
@@ -60,12 +243,17 @@ void Conjunction::add_outer_quantifier(const Quantifier& q){
     this->quantifiers.insert(this->quantifiers.begin(), Quantifier(q));
 }
 
+void Conjunction::add_shared_quantifier(const Quantifier& q){
+    this->add_outer_quantifier(q);
+    this->shared_quantifiers++;
+}
+
 /** Check to see if every positive literal in a conjunction is satisfied. Does
  *  not check negative literals.
  */
-bool Conjunction::check(boost::dynamic_bitset<unsigned long> x, 
-           boost::dynamic_bitset<unsigned long> y, 
-           boost::dynamic_bitset<unsigned long> z){
+bool Conjunction::check(const boost::dynamic_bitset<unsigned long>& x, 
+           const boost::dynamic_bitset<unsigned long>& y, 
+           const boost::dynamic_bitset<unsigned long>& z) const{
     for(int i = 0; i < this->literals.size(); i++){
         if(! (this->literals[i]->check(x,y,z)) )
             return false;
@@ -99,6 +287,7 @@ std::string Conjunction::to_string() const{
 Conjunction::Conjunction(){
     this->literals = std::vector<Literal*>();
     this->neg_literals = std::vector<Literal*>();    
+    this->shared_quantifiers = 0;
 }
 
 /*************** Implementation of Literal ************************/
@@ -114,9 +303,9 @@ void Literal::set_default_eca(int eca_num){
  * this function will return true. If this literal is "NOT(the tracks are equal)"
  * and the tracks *are* equal, it will still return true.
  */
-bool Literal::check(boost::dynamic_bitset<unsigned long> x, 
-           boost::dynamic_bitset<unsigned long> y, 
-           boost::dynamic_bitset<unsigned long> z){
+bool Literal::check(const boost::dynamic_bitset<unsigned long>& x, 
+           const boost::dynamic_bitset<unsigned long>& y, 
+           const boost::dynamic_bitset<unsigned long>& z) const{
     bool applies = eca[(4 * x[i1]) + (2 * y[i1]) + (z[i1])] == y[i2];
     return applies;
 }
@@ -172,3 +361,76 @@ std::string Literal::to_string() const{
         ret += ")";
     return ret;
 }
+
+
+/*************** Implementation of CompiledConjunction ************************/
+
+CompiledConjunction::CompiledConjunction(){
+}
+
+/* Copy the tracks and ECA rule of a literal into a table entry.
+ */
+static CompiledConjunction::Entry compile_literal(const Literal& l, 
+                                                  const std::vector<int>& track_of_var){
+    CompiledConjunction::Entry e;
+    e.i1 = track_of_var.empty() ? l.i1 : track_of_var[l.i1];
+    e.i2 = track_of_var.empty() ? l.i2 : track_of_var[l.i2];
+    e.eca = (unsigned char) l.eca.to_ulong();
+    return e;
+}
+
+CompiledConjunction::CompiledConjunction(const Conjunction& f, 
+                                         const std::vector<int>& track_of_var){
+    for(int i = 0; i < f.literals.size(); i++)
+        this->literals.push_back(compile_literal(*f.literals[i], track_of_var));
+    for(int i = 0; i < f.neg_literals.size(); i++)
+        this->neg_literals.push_back(compile_literal(*f.neg_literals[i], track_of_var));
+}
+
+/* Word @param w of the mask of characters with track @param t set.
+ */
+static unsigned long track_word(int t, int w){
+    static const unsigned long patterns[6] = {
+        0xAAAAAAAAAAAAAAAAUL, 0xCCCCCCCCCCCCCCCCUL, 0xF0F0F0F0F0F0F0F0UL,
+        0xFF00FF00FF00FF00UL, 0xFFFF0000FFFF0000UL, 0xFFFFFFFF00000000UL };
+    if(t < 6)
+        return patterns[t];
+    return ((w >> (t - 6)) & 1) ? ~0UL : 0UL;
+}
+
+/* Word @param w of the truth table over z of a literal on track @param t
+ * which holds @param when_clear and/or @param when_set (the value of z on t).
+ */
+static unsigned long literal_word(bool when_clear, bool when_set, int t, int w){
+    if(when_clear && when_set) return ~0UL;
+    if(when_set) return track_word(t, w);
+    if(when_clear) return ~track_word(t, w);
+    return 0UL;
+}
+
+void CompiledConjunction::evaluate_row(unsigned long x, unsigned long y, int tracks,
+                                       std::vector<unsigned long>& pass, 
+                                       std::vector<unsigned long>& neg_sat) const{
+    unsigned long characters = 1UL << tracks;
+    int words = (characters + 63) / 64;
+    unsigned long last_word = (characters % 64) ? ((1UL << (characters % 64)) - 1) : ~0UL;
+    
+    pass.assign(words, ~0UL);
+    pass[words - 1] = last_word;
+    for(int i = 0; i < this->literals.size(); i++){
+        const Entry& e = this->literals[i];
+        bool when_clear = holds(e, x, y, 0UL);
+        bool when_set = holds(e, x, y, 1UL << e.i1);
+        for(int w = 0; w < words; w++)
+            pass[w] &= literal_word(when_clear, when_set, e.i1, w);
+    }
+    
+    neg_sat.resize(this->neg_literals.size() * words);
+    for(int i = 0; i < this->neg_literals.size(); i++){
+        const Entry& e = this->neg_literals[i];
+        bool when_clear = holds(e, x, y, 0UL);
+        bool when_set = holds(e, x, y, 1UL << e.i1);
+        for(int w = 0; w < words; w++)
+            neg_sat[i * words + w] = ~literal_word(when_clear, when_set, e.i1, w);
+    }
+}
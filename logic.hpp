@@ -45,9 +45,9 @@ class Literal
         Literal(char v1, char v2);
         Literal(char v1, char v2, int eca_num, bool negated);
 
-        bool check(boost::dynamic_bitset<unsigned long> x, 
-                   boost::dynamic_bitset<unsigned long> y, 
-                   boost::dynamic_bitset<unsigned long> z);  
+        bool check(const boost::dynamic_bitset<unsigned long>& x, 
+                   const boost::dynamic_bitset<unsigned long>& y, 
+                   const boost::dynamic_bitset<unsigned long>& z) const;  
                    
         std::string to_string() const;
         
@@ -65,6 +65,20 @@ class Quantifier
         Quantifier(bool negated, bool universal, char var);
 };
 
+/* A maximal run of quantifiers which can be applied to an automaton one
+ * after another without complementing in between: the variables are
+ * projected together, after complementing first if @field complement_first
+ * is set.
+ */
+struct QuantifierBlock
+{
+    bool complement_first;
+    std::vector<int> variables; // innermost quantifier first
+};
+
+/* The outcome of Conjunction::simplify on a whole formula. */
+enum Decision { DECIDED_FALSE, DECIDED_TRUE, UNDECIDED };
+
 class Conjunction
 {
     public:    
@@ -72,23 +86,163 @@ class Conjunction
         std::vector<Literal*> literals;
         std::vector<Quantifier> quantifiers;
         std::vector<Literal*> neg_literals;
+        
+        /* The number of outermost quantifiers which were written outside a
+         * disjunction, as in Ex (A | B). The parser copies them into every
+         * conjunction of the disjunction, but they apply to the disjunction
+         * as a whole: Ax (A | B) is not (Ax A) | (Ax B).
+         */
+        int shared_quantifiers;
     
    
         static std::vector<Conjunction*>* last_formula_parsed;
     
-        bool check(boost::dynamic_bitset<unsigned long> x, 
-                   boost::dynamic_bitset<unsigned long> y, 
-                   boost::dynamic_bitset<unsigned long> z);
+        bool check(const boost::dynamic_bitset<unsigned long>& x, 
+                   const boost::dynamic_bitset<unsigned long>& y, 
+                   const boost::dynamic_bitset<unsigned long>& z) const;
 
         std::string to_string() const;
          
+        /* The indices of the variables which appear in some literal, in
+         * increasing order.
+         */
+        std::vector<int> variables() const;
+        
+        /* Plan how to apply the quantifiers from @param first up to (not
+         * including) @param last, innermost first, to an automaton for what
+         * they quantify. Qx phi is Ex phi or ~Ex ~phi, so a quantifier is
+         * a projection of phi (E) or of ~phi (A); the automaton only has to
+         * be complemented when it holds the other one. Quantifiers between
+         * two such complements form one block in @param blocks.
+         * @param negate_result is set if the automaton left after the last
+         * block still has to be complemented. Returns the total number of
+         * complements, including that last one.
+         */
+        int plan_quantifiers(int first, int last, 
+                             std::vector<QuantifierBlock>& blocks, bool& negate_result) const;
+        
         void add_literal(Literal* l);
         void add_inner_quantifier(const Quantifier& q);
         void add_outer_quantifier(const Quantifier& q);
+        void add_shared_quantifier(const Quantifier& q);
+        
+        /* Normalize the literals: order the variables of identity literals
+         * (x==y is y==x), sort both lists, remove duplicates and literals
+         * which always hold (x==x). Returns false if the literals can never
+         * all hold, because of a literal ~(x==x) or a literal which appears
+         * both positively and negatively.
+         */
+        bool simplify_literals();
+        
+        /* True if quantifier @param i binds nothing: its variable appears in
+         * no literal, or is quantified again further in.
+         */
+        bool quantifier_is_dead(int i) const;
+        
+        /* Remove quantifier @param i, which should be dead. Since ~Qx phi is
+         * ~phi when x does not appear in phi, and Q'y ~phi is ~Q''y phi for
+         * the dual Q'' of Q', a negation on quantifier i is moved to
+         * quantifier i - 1 by negating it and swapping A and E. Returns false,
+         * keeping the quantifier, if it is negated and quantifier i - 1 is
+         * before @param first.
+         */
+        bool drop_quantifier(int i, int first);
+        
+        /* The value of the quantifiers from @param first up to (not
+         * including) @param last applied to a constant @param value: only
+         * their negations matter.
+         */
+        bool quantify_constant(int first, int last, bool value) const;
+        
+        /* Simplify the disjunction @param formula in place before any
+         * automaton is built: simplify the literals of each disjunct, drop
+         * dead quantifiers, sort runs of unnegated quantifiers of one kind by
+         * variable, and drop disjuncts whose literals are contradictory.
+         * A disjunct whose literals are contradictory or all gone is a
+         * constant, which may decide the whole formula.
+         */
+        static Decision simplify(std::vector<Conjunction*>& formula);
         
         Conjunction();
         //Conjunction(int max_tracks);
         //Conjunction(const std::vector<Quantifier>& global_quantifiers, int max_tracks);
 };
 
+/* A Conjunction compiled into flat tables of literals which are evaluated on
+ * packed slices: bit t of a packed slice is the value of track t (the same
+ * numbering as the characters built in NBW::build_helper), so a slice of up
+ * to 64 tracks fits in one word. Checking a literal is then a few shifts and
+ * one lookup in its ECA byte, with no copies and no allocation.
+ */
+class CompiledConjunction
+{
+    public:
+        struct Entry{
+            int i1; // track 1 index
+            int i2; // track 2 index
+            unsigned char eca; // rule table: bit (4x+2y+z) is the next value
+        };
+        
+        std::vector<Entry> literals;
+        std::vector<Entry> neg_literals;
+        
+        CompiledConjunction();
+        
+        /* Compile @param f. If @param track_of_var is given, variable v is
+         * read from track track_of_var[v] of the packed slices; otherwise
+         * track v.
+         */
+        CompiledConjunction(const Conjunction& f, 
+                            const std::vector<int>& track_of_var = std::vector<int>());
+        
+        static unsigned long pack(const boost::dynamic_bitset<unsigned long>& s){
+            return s.none() ? 0UL : s.to_ulong();
+        }
+        
+        /* Whether the condition of @param e holds between the packed slices
+         * (ignoring negation, like Literal::check).
+         */
+        static bool holds(const Entry& e, unsigned long x, unsigned long y, unsigned long z){
+            unsigned int rule = (((x >> e.i1) & 1) << 2) | (((y >> e.i1) & 1) << 1) | ((z >> e.i1) & 1);
+            return ((e.eca >> rule) & 1) == ((y >> e.i2) & 1);
+        }
+        
+        /* True if every positive literal holds. */
+        bool check(unsigned long x, unsigned long y, unsigned long z) const{
+            for(int i = 0; i < this->literals.size(); i++)
+                if(!holds(this->literals[i], x, y, z))
+                    return false;
+            return true;
+        }
+        
+        /* Bit i is set if negative literal i is satisfied, i.e. its
+         * condition fails. Only covers the first 64 negative literals; 
+         * use holds() directly for the others.
+         */
+        unsigned long neg_lits_sat(unsigned long x, unsigned long y, unsigned long z) const{
+            unsigned long sat = 0;
+            int max = this->neg_literals.size() < 64 ? this->neg_literals.size() : 64;
+            for(int i = 0; i < max; i++)
+                if(!holds(this->neg_literals[i], x, y, z))
+                    sat |= (1UL << i);
+            return sat;
+        }
+        
+        /* Evaluate the formula for the packed slices (x, y) against every
+         * next slice z of @param tracks tracks at once. Since a literal only
+         * looks at track i1 of z, its truth table over z is all characters,
+         * none, or those with track i1 set (or clear), so the tables are
+         * combined a word (64 characters) at a time. Bit z of the masks
+         * stands for the character with packed slice z; each mask has
+         * ceil(2^tracks / 64) words.
+         * @param pass gets the characters on which every positive literal
+         * holds, and the mask of negative literal i, which starts at word
+         * i * (words per mask) of @param neg_sat, the characters on which
+         * it is satisfied. Both are resized as needed.
+         */
+        void evaluate_row(unsigned long x, unsigned long y, int tracks,
+                          std::vector<unsigned long>& pass, 
+                          std::vector<unsigned long>& neg_sat) const;
+};
+
 #endif
\ No newline at end of file
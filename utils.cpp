@@ -15,6 +15,8 @@
 
 std::string default_alphabet = "abcdefghijklmnopqrstuvwxyz";
 
+bool verbose_output = false;
+
 /** Read a line from an input file, ignoring lines that begin with '#'.
  */
 void get_next_line(std::istream &input, std::string &buffer){
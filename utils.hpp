@@ -39,6 +39,20 @@ class Literal;
  */
 #define NBW_MAX_CACHED_SIZE 10
 
+/** Whether to build the automaton of a conjunction from one small automaton
+ * per literal, intersected one at a time, projecting each variable of the
+ * innermost existential quantifiers as soon as no remaining literal
+ * mentions it (like early quantification in image computation). Only used
+ * for one-way-infinite (OMEGA) automata.
+ */
+#define PARTITION_CONJUNCTIONS true
+
+/** How much the cache of formula automata (AutomatonCache in buchi_gen.hpp)
+ * may hold, counted in transition matrix cells (states * characters) of the
+ * automata stored. 0 turns the cache off.
+ */
+#define AUTOMATON_CACHE_CELLS (1 << 20)
+
 /**
  * Converts an int to a string using boost. Otherwise you can accidentally 
  * append characters to strings when you're dealing with ints in the ASCII
@@ -63,6 +77,13 @@ enum Boundary { OMEGA, ZETA };
  */
 extern std::string default_alphabet;
 
+/**
+ * Defined in utils.cpp, this is set (by the command line interface) when
+ * the user asks for verbose output. Constructions check it before printing
+ * statistics about the work they are doing.
+ */
+extern bool verbose_output;
+
 /* The adjacency list format which is used for Boost graphs looks like this */
 typedef boost::adjacency_list< boost::vecS, 
                                boost::vecS, 